@@ -13,14 +13,6 @@
  */
 
 /**
- * TODO: use a fenwick tree to optimize find_bin down to log n (if worth it)
- *       use a trie/balanced tree in big enough bins to optimize find_chunk
- *           down to log n
- *       support alignment
- *       free external alloc'ed memory
- *       thread safeness
- *
- *
  * The main algorithm idea was taken from:
  *
  * http://gee.cs.oswego.edu/dl/html/malloc.html
@@ -67,6 +59,89 @@
 #include <string.h> /* for memset in calloc and memcpy in realloc */
 
 
+/**
+ * If MALLOC_THREADS is defined, every thread gets its own memory context
+ * (init_malloc must be called once per thread, each with its own buffer),
+ * and free'ing memory owned by another thread's context is safe: the chunk
+ * is pushed onto a lock-free list in the owning context, which drains it
+ * lazily on its next malloc
+ */
+#ifdef MALLOC_THREADS
+#define MALLOC_TLS __thread
+#else
+#define MALLOC_TLS
+#endif
+
+
+/**
+ * If MALLOC_SHARED is defined, every internal link is stored as an
+ * offset from the context base instead of a raw pointer, so one heap in
+ * a shared segment can be mapped at different addresses by different
+ * processes, and a lock in the context arbitrates malloc/free between
+ * them. REF converts a pointer to its stored form, PTR back; both are
+ * the identity (and cost nothing) in normal builds
+ *
+ * Note that both evaluate their argument more than once: no side
+ * effects in it
+ *
+ * Not combinable with per-thread contexts
+ */
+#ifdef MALLOC_SHARED
+
+#ifdef MALLOC_THREADS
+#error MALLOC_SHARED and MALLOC_THREADS cannot be combined
+#endif
+
+#define REF( ptr )                                                      \
+    ( (__typeof__( ptr ))( (ptr) ? (void*)( (char*)(ptr) -              \
+                                            (char*)context )            \
+                                 : NULL ) )
+
+#define PTR( ref )                                                      \
+    ( (__typeof__( ref ))( (ref) ? (void*)( (char*)context +            \
+                                            ( (char*)(void*)(ref) -     \
+                                              (char*)0 ) )              \
+                                 : NULL ) )
+
+/**
+ * Futex-style lock arbitrating the shared heap between processes
+ * (acquire-exchange spin with a passive re-check; a real futex wait
+ * would need a syscall, which this file stays free of)
+ */
+#define CONTEXT_LOCK()                                                  \
+    do {                                                                \
+        while ( __atomic_exchange_n( &context->lock, 1,                 \
+                                     __ATOMIC_ACQUIRE ) )               \
+            while ( __atomic_load_n( &context->lock,                    \
+                                     __ATOMIC_RELAXED ) )               \
+                ;                                                       \
+    } while ( 0 )
+
+#define CONTEXT_UNLOCK()                                                \
+    __atomic_store_n( &context->lock, 0, __ATOMIC_RELEASE )
+
+#else
+
+#define REF( ptr ) ( ptr )
+#define PTR( ref ) ( ref )
+
+#define CONTEXT_LOCK()   ( (void)0 )
+#define CONTEXT_UNLOCK() ( (void)0 )
+
+#endif
+
+
+/**
+ * Hints the prefetcher at memory we're about to chase, hiding the cache
+ * miss behind the current iteration's compare. No-op where unsupported
+ */
+#ifdef __GNUC__
+#define PREFETCH( address ) __builtin_prefetch( address )
+#else
+#define PREFETCH( address ) ( (void)0 )
+#endif
+
+
 /**
  * If the requested size is smaller than this, and a perfect fit isn't found,
  * try to use the chunk contiguous to the last allocation
@@ -76,10 +151,40 @@
 #define MAX_SMALL_REQUEST 256
 
 
+/**
+ * Chunk sizes live in 31-bit fields, which caps buffers at 2 GB but keeps
+ * the allocated-chunk overhead at 8 bytes. Define MALLOC_BIG_HEAP to
+ * widen them to 63 bits (buffers up to 4 EB, 16 bytes of overhead per
+ * chunk); the compact format stays the default for small targets
+ */
+#ifdef MALLOC_BIG_HEAP
+
+typedef size_t chunk_field;
+
+#define CHUNK_SIZE_BITS 63
+
+#else
+
+typedef unsigned int chunk_field;
+
+#define CHUNK_SIZE_BITS 31
+
+#endif
+
+
 struct free_header {
 
-    unsigned int status : 1;
-    unsigned int size   : 31;
+    chunk_field status : 1;
+    chunk_field size   : CHUNK_SIZE_BITS;
+
+#ifdef MALLOC_HARDEN
+    chunk_field canary;
+#endif
+
+#ifdef MALLOC_PROFILE
+    chunk_field tag;
+    chunk_field stamp;
+#endif
 
     struct free_header* next;
     struct free_header* prev;
@@ -88,14 +193,57 @@ struct free_header {
 
 struct inuse_header {
 
-    unsigned int status : 1;
-    unsigned int size   : 31;
+    chunk_field status : 1;
+    chunk_field size   : CHUNK_SIZE_BITS;
+
+#ifdef MALLOC_HARDEN
+    chunk_field canary;
+#endif
+
+#ifdef MALLOC_PROFILE
+    chunk_field tag;   /* caller-provided allocation-site id */
+    chunk_field stamp; /* allocation-count clock at alloc time */
+#endif
 };
 
 
 struct footer {
 
-    unsigned int size : 32;
+#ifdef MALLOC_HARDEN
+    chunk_field canary;
+#endif
+
+    chunk_field size : CHUNK_SIZE_BITS + 1;
+};
+
+
+/**
+ * Free chunks big enough for a trie bin carry, besides the usual ring
+ * links, their position in the bin's size-keyed bitwise trie. Only one
+ * chunk per size (the ring's representative) is an actual trie node; the
+ * rest hang off its ring with a NULL parent
+ *
+ * Must be a prefix-compatible extension of struct free_header
+ */
+struct tree_header {
+
+    chunk_field status : 1;
+    chunk_field size   : CHUNK_SIZE_BITS;
+
+#ifdef MALLOC_HARDEN
+    chunk_field canary;
+#endif
+
+#ifdef MALLOC_PROFILE
+    chunk_field tag;
+    chunk_field stamp;
+#endif
+
+    struct tree_header* next;
+    struct tree_header* prev;
+
+    struct tree_header* child[2];
+    struct tree_header* parent;
 };
 
 
@@ -104,6 +252,72 @@ struct footer {
 #define INUSE_STATUS 1
 
 
+/**
+ * Chunks parked in a cache (fastbin, magazine, deferred list) carry this
+ * flag in the low bit of their size field - free since all chunk sizes
+ * are multiples of 16. A second free of a cached chunk then fails the
+ * size-granularity validation no matter how deep in the cache it sits
+ */
+#define CHUNK_CACHED_FLAG 1
+
+
+/**
+ * With MALLOC_HARDEN, every header and footer carries a canary derived
+ * from its own address, checked before free trusts the boundary tags
+ * (and by check_malloc); freed payloads are also poisoned. A couple of
+ * stores per operation, cheap enough to stay on in production
+ */
+#ifdef MALLOC_HARDEN
+
+inline static chunk_field chunk_canary ( void* location );
+
+#define PROTECT_HEADER( header )  \
+    ( (void)( ( (struct inuse_header*)(header) )->canary = \
+                  chunk_canary( header ) ) )
+
+#define HEADER_CANARY_OK( header ) \
+    ( (header)->canary == chunk_canary( (void*)(header) ) )
+
+#define FOOTER_CANARY_OK( footer ) \
+    ( (footer)->canary == chunk_canary( (void*)(footer) ) )
+
+#define POISON_BYTE 0xde
+
+#else
+
+#define PROTECT_HEADER( header )   ( (void)0 )
+#define HEADER_CANARY_OK( header ) 1
+#define FOOTER_CANARY_OK( footer ) 1
+
+#endif
+
+
+/**
+ * Writes the footer of a chunk (size, and its canary when hardening)
+ *
+ * @param chunk  start of the chunk
+ * @param size   size of the chunk (in bytes)
+ */
+inline static void set_footer ( void* chunk, size_t size ) {
+
+    struct footer* footer = (struct footer*)( (char*)chunk + size ) - 1;
+
+    footer->size = size;
+
+#ifdef MALLOC_HARDEN
+    footer->canary = chunk_canary( footer );
+#endif
+}
+
+
+/**
+ * All chunk sizes are multiples of 16 and buffers are carved so payloads
+ * start 16-byte aligned, whatever the header size, so user data never
+ * straddles an extra cache line (or page) by a few header bytes
+ */
+#define ROUND_CHUNK_SIZE( size ) ( ( (size) + 15 ) & ~(size_t)15 )
+
+
 #define MIN_FREE_CHUNK_SIZE  ( sizeof( struct free_header ) + \
                                sizeof( struct footer ) )
 
@@ -112,13 +326,23 @@ struct footer {
 
 
 /**
- * Bin sizes from 16 bytes to 2 GB
+ * Bin sizes from 16 bytes to 2 GB (or 4 EB with MALLOC_BIG_HEAP)
  *
  * Note: bin_sizes[0] is never used, since a free_header must fit in a free
  *       chunk
  */
 
+/**
+ * With MALLOC_MAX_HEAP_SIZE defined, only the bins reachable for that
+ * heap exist (the count comes from malloc.h, where the public stats
+ * arrays must agree), and the unreachable rows of bin_sizes drop out of
+ * the build entirely
+ */
+#ifdef MALLOC_MAX_HEAP_SIZE
+#define BIN_NUMBER  MALLOC_BIN_NUMBER
+#else
 #define BIN_NUMBER  ( sizeof( bin_sizes ) / sizeof( bin_sizes[0] ) )
+#endif
 
 static const size_t bin_sizes[] = {
 
@@ -128,646 +352,4602 @@ static const size_t bin_sizes[] = {
        248,   256,   264,   272,   280,   288,   296,   304,   312,   320,
        328,   336,   344,   352,   360,   368,   376,   384,   392,   400,
        408,   416,   424,   432,   440,   448,   456,   464,   472,   480,
-       488,   496,   504,   512,   576,   640,   768,  1024,  2048,  4096,
-         0x2000,     0x4000,     0x8000,    0x10000,    0x20000,    0x40000,
-        0x80000,   0x100000,   0x200000,   0x400000,   0x800000,  0x1000000,
-      0x2000000,  0x4000000,  0x8000000, 0x10000000, 0x20000000, 0x40000000,
-     0x80000000
+       488,   496,   504,   512,   576,   640,   768,  1024,  2048,  4096
+
+#if !defined MALLOC_MAX_HEAP_SIZE || MALLOC_MAX_HEAP_SIZE >= 0x2000
+    ,    0x2000,     0x4000,     0x8000,    0x10000,    0x20000,    0x40000
+#endif
+#if !defined MALLOC_MAX_HEAP_SIZE || MALLOC_MAX_HEAP_SIZE >= 0x80000
+    ,   0x80000,   0x100000,   0x200000,   0x400000,   0x800000,  0x1000000
+#endif
+#if !defined MALLOC_MAX_HEAP_SIZE || MALLOC_MAX_HEAP_SIZE >= 0x2000000
+    , 0x2000000,  0x4000000,  0x8000000, 0x10000000, 0x20000000, 0x40000000
+#endif
+#if !defined MALLOC_MAX_HEAP_SIZE || MALLOC_MAX_HEAP_SIZE >= 0x80000000
+    , 0x80000000
+#endif
+
+#ifdef MALLOC_BIG_HEAP
+    ,
+     (size_t)1 << 32, (size_t)1 << 33, (size_t)1 << 34, (size_t)1 << 35,
+     (size_t)1 << 36, (size_t)1 << 37, (size_t)1 << 38, (size_t)1 << 39,
+     (size_t)1 << 40, (size_t)1 << 41, (size_t)1 << 42, (size_t)1 << 43,
+     (size_t)1 << 44, (size_t)1 << 45, (size_t)1 << 46, (size_t)1 << 47,
+     (size_t)1 << 48, (size_t)1 << 49, (size_t)1 << 50, (size_t)1 << 51,
+     (size_t)1 << 52, (size_t)1 << 53, (size_t)1 << 54, (size_t)1 << 55,
+     (size_t)1 << 56, (size_t)1 << 57, (size_t)1 << 58, (size_t)1 << 59,
+     (size_t)1 << 60, (size_t)1 << 61, (size_t)1 << 62
+#endif
 };
 
 
-struct memory_context {
+/**
+ * Max number of memory areas that can be registered (via add_malloc_buffer)
+ * in a single memory context. Areas added past this limit are still usable
+ * for allocations, but the context can't tell it owns them
+ */
+#define MAX_MALLOC_BUFFERS 32
 
-    size_t free_memory;
-    size_t last_chunk_size;
 
-    void* ( *external_alloc )( size_t, size_t* );
+struct malloc_buffer {
 
-    struct free_header* last_chunk;
-    struct free_header  bins[ BIN_NUMBER ];
+    void*  base;
+    size_t size;
+    size_t live;    /* inuse chunks inside (only for registered buffers) */
+    char*  clean;   /* start of the still-OS-zeroed tail of a buffer
+                       registered with add_malloc_buffer_zeroed, or NULL */
+    int    node;    /* NUMA node the buffer lives on, or -1 for unknown */
 };
 
 
 /**
- * Global current memory context
+ * Max number of simultaneous direct (bin-bypassing) large allocations
+ *
+ * @see set_malloc_direct_threshold
  */
-static struct memory_context* context;
+#define MAX_DIRECT_ALLOCS 32
 
 
 /**
- * Performs a binary search to find the first bin of size >= to a given size
- *
- * @param size  size of the memory (in bytes)
- *
- * @return a pointer to the bin
+ * Number of 32-bit words needed for one occupancy bit per bin
  */
-static struct free_header* find_bin ( size_t size ) {
-
-    size_t min_bin = 0, max_bin = BIN_NUMBER, curr_bin;
-
-    assert( size < bin_sizes[ BIN_NUMBER - 1 ] );
-
-    while ( min_bin + 1 != max_bin ) {
+#define BIN_MAP_WORDS ( ( BIN_NUMBER + 31 ) / 32 )
 
-        curr_bin = ( min_bin + max_bin ) / 2;
 
-        if ( bin_sizes[ curr_bin ] <= size )
-
-            min_bin = curr_bin;
-        else
-            max_bin = curr_bin;
-    }
+/**
+ * Bins from TREE_BIN_MIN up cover huge size ranges, so instead of a
+ * sorted list they keep their chunks in a bitwise trie keyed on the
+ * size's distinguishing bits, making find/insert/remove O(log n)
+ *
+ * TREE_SIZE_MIN must equal bin_sizes[ TREE_BIN_MIN ]
+ */
+#define TREE_BIN_MIN  70
 
-    return context->bins + min_bin;
-}
+#define TREE_SIZE_MIN 0x2000
 
 
 /**
- * Finds the first chunk of memory >= to a given size in a given bin
- *
- * @param bin   pointer to bin to explore
- * @param size  size of memory (in bytes)
+ * Small-object magazines: one LIFO stack of ready-to-hand-out chunks per
+ * 8-byte size class up to MAX_SMALL_REQUEST, so alloc/free of small
+ * objects skips the bins and boundary-tag coalescing entirely
  *
- * @return a pointer to the chunk's free header
+ * @see set_malloc_magazines
  */
-inline static struct free_header* find_chunk ( struct free_header* bin,
-                                               size_t size )
-{
-    struct free_header* chunk = bin;
+#define MAGAZINE_NUMBER   ( MAX_SMALL_REQUEST / 8 )
 
-    do {
+#define MAGAZINE_CAPACITY 8
 
-        chunk = chunk->next;
 
-    } while ( chunk != bin && chunk->size < size );
+struct magazine {
 
-    return chunk;
-}
+    size_t count;
+    struct free_header* chunks[ MAGAZINE_CAPACITY ];
+};
 
 
 /**
- * Finds the first chunk of memory > to a given size in a given bin
- *
- * Note the use of > instead of >=, like in find_chunk. This version
- * is used to implement a tie breaking least-recently-used strategy,
- * which mantains (for some reason) low memory fragmentation
+ * Small-page spans: page-sized regions whose metadata (size class, slot
+ * occupancy bitmap) lives at the start of the page instead of around
+ * every object, so small allocations carry no in-line header or footer
+ * at all - the slot address alone determines everything. Opt-in
  *
- * @param bin   pointer to bin to explore
- * @param size  size of memory (in bytes)
- *
- * @return a pointer to the chunk's free header
+ * @see set_malloc_small_pages
  */
-inline static struct free_header* find_upper_chunk ( struct free_header* bin,
-                                                     size_t size )
-{
-    struct free_header* chunk = bin;
+#define SPAN_SIZE     4096
 
-    do {
+#define SPAN_HEADER   64
 
-        chunk = chunk->next;
+#define SPAN_SLOT_MAX 128
 
-    } while ( chunk != bin && chunk->size <= size );
+#define MAX_SPANS     64
 
-    return chunk;
-}
+
+struct span {
+
+    size_t       class_size;
+    size_t       used;
+    unsigned int bitmap[ 8 ];
+};
 
 
 /**
- * Adds a chunk of memory to the bins
+ * Fastbins: per-size-class LIFO stacks of freed chunks, linked through
+ * their (otherwise dormant) header next pointers. Unlike the magazines
+ * they exist purely for cache temperature: a free-then-alloc of the same
+ * size returns the exact same lines, without touching status, footer or
+ * bins at all
  *
- * @param memory  free memory buffer
- * @param size    free memory buffer size (in bytes)
+ * @see set_malloc_fastbins
  */
-static void add_free_chunk ( void* memory, size_t size ) {
-
-    struct free_header* header;
-    struct footer*      footer;
+#define FASTBIN_DEPTH 16
 
-    assert( size >= MIN_FREE_CHUNK_SIZE );
 
-    header = memory;
+struct memory_context {
 
-    header->status = FREE_STATUS;
-    header->size   = size;
+#ifdef MALLOC_SHARED
+    size_t lock;
+#endif
 
-    header->next = find_upper_chunk( find_bin( size ), size );
-    header->prev = header->next->prev;
+    size_t free_memory;
+    size_t last_chunk_size;
 
-    header->next->prev = header;
-    header->prev->next = header;
+    void* ( *external_alloc )( size_t, size_t* );
 
-    footer = (struct footer*)( (char*)memory + size ) - 1;
+    struct free_header* last_chunk;
 
-    footer->size = size;
-}
+#ifdef MALLOC_THREADS
+    struct free_header* remote_free;
+#endif
 
+    size_t mutations;   /* bumped on every structural heap change, so a
+                           parked check_malloc_step cursor knows to
+                           restart instead of resuming desynchronized */
 
-/**
- * Splits a free chunk of memory in two chunks, the first of a specified size,
- * and the second goes back to the bins of free chunks
- *
- * @param header  pointer to the header of a free memory chunk
- * @param size    size of the desired chunk
- *
- * @return a pointer to the first chunk (which is set "inuse")
- */
-static void* split_chunk ( struct free_header* header, size_t size ) {
+    size_t buffer_count;
+    struct malloc_buffer buffers[ MAX_MALLOC_BUFFERS ];
 
-    size_t left_size = header->size - size;
+    void ( *external_free )( void*, size_t );
 
-    if ( left_size < MIN_FREE_CHUNK_SIZE ) {
+    size_t low_threshold;
+    void ( *low_callback )( size_t );
+    void ( *error_handler )( void* );
 
-        size += left_size;
-        left_size = 0;
+    size_t direct_threshold;
+    size_t direct_count;
+    struct malloc_buffer direct_allocs[ MAX_DIRECT_ALLOCS ];
 
-    } else {
+    struct malloc_stats stats;
 
-        context->last_chunk = (struct free_header*)( (char*)header + size );
+#ifdef MALLOC_TRACE
+    struct malloc_trace_ring* tracer;
+#endif
 
-        add_free_chunk( context->last_chunk, left_size );
-    }
+    size_t page_size;
+    int    policy;
 
-    header->status = INUSE_STATUS;
-    header->size   = size;
-    header->next   = NULL;
-    header->prev   = NULL;
+    /* bounded candidate walk for the address-ordered policy */
+#define POLICY_SEARCH_LIMIT 64
 
-    ( (struct footer*)( (char*)header + size ) - 1 )->size = size;
 
-    context->free_memory    -= size;
-    context->last_chunk_size = left_size;
+#ifdef MALLOC_PROFILE
+    size_t pending_tag;
+#endif
 
-    return (struct inuse_header*)header + 1;
-}
+    int             magazines_on;
+    struct magazine magazines[ MAGAZINE_NUMBER ];
 
+    int          spans_on;
+    size_t       span_count;
+    struct span* spans[ MAX_SPANS ];
 
-/**
- * Adds a new memory area for allocations to the current memory context
- *
- * The buffer should be < 2 GB
- *
- * @param memory  memory buffer
- * @param size    memory buffer size (in bytes)
- */
-void add_malloc_buffer ( void* memory, size_t size ) {
+    int                 fastbins_on;
+    size_t              fastbin_counts[ MAGAZINE_NUMBER ];
+    struct free_header* fastbins[ MAGAZINE_NUMBER ];
 
-    struct bound {
+    int                 deferred_on;
+    size_t              incoming_bytes;
+    struct free_header* incoming;
 
-        struct inuse_header header;
-        struct footer       footer;
+    struct tree_header* tree_roots[ BIN_NUMBER > TREE_BIN_MIN
+                                        ? BIN_NUMBER - TREE_BIN_MIN : 1 ];
 
-    } *bound;
+    unsigned int bin_map[ BIN_MAP_WORDS ];
 
-    if ( size < 2 * sizeof( struct bound ) + MIN_FREE_CHUNK_SIZE )
-        return;
+    struct free_header  bins[ BIN_NUMBER ];
+};
 
-    bound  = memory;
 
-    bound->header.status = INUSE_STATUS;
-    bound->header.size   = sizeof( struct bound );
-    bound->footer.size   = sizeof( struct bound );
+/**
+ * Global current memory context (one per thread if MALLOC_THREADS is on)
+ */
+static MALLOC_TLS struct memory_context* context;
 
-    bound = (struct bound*)((char*)memory + size) - 1;
 
-    bound->header.status = INUSE_STATUS;
-    bound->header.size   = sizeof( struct bound );
-    bound->footer.size   = sizeof( struct bound );
+#ifdef MALLOC_HARDEN
 
-    memory = (struct bound*)memory + 1;
-    size  -= 2 * sizeof( struct bound );
+inline static chunk_field chunk_canary ( void* location ) {
 
-    add_free_chunk( memory, size );
+    /* derived from the context-relative position, so canaries survive a
+       freeze/thaw relocation and differently-mapped shared segments */
 
-    context->free_memory += size;
+    return (chunk_field)( ( (size_t)( (char*)location - (char*)context )
+                            >> 3 ) * 2654435761ul ^ 0xca11ab1eul );
 }
 
+#endif
+
 
 /**
- * Creates a new malloc context in the given memory buffer. Uses the remaining
- * memory for allocations
+ * Tells whether an allocation came from one of the memory areas registered
+ * in a given context
  *
- * Must be called before any malloc or free (unless a memory context has been
- * set manually)
+ * Only needed by the cross-thread free dispatch and by an assert, so it
+ * doesn't exist in assert-less single-threaded builds
  *
- * Size must be, at least, 180*sizeof( void* ) + 91*sizeof( size_t ), to let a
- * memory context fit
+ * @param ctx     memory context to query
+ * @param memory  pointer to allocated memory
  *
- * @param memory  memory buffer
- * @param size    memory buffer size (in bytes)
+ * @return 1 if the memory belongs to the context, 0 otherwise
  */
-void init_malloc ( void* memory, size_t size ) {
-
-    struct free_header* bin;
+#if defined MALLOC_THREADS || !defined NDEBUG
 
-    assert( size >= sizeof( struct memory_context ) );
+static int context_owns ( struct memory_context* ctx, void* memory ) {
 
-    context = memory;
-    memory  = (struct memory_context*)memory + 1;
-    size   -= sizeof( struct memory_context );
+    size_t count, pos;
 
-    context->free_memory     = 0;
-    context->last_chunk_size = 0;
-    context->external_alloc  = NULL;
+#ifdef MALLOC_THREADS
+    count = __atomic_load_n( &ctx->buffer_count, __ATOMIC_ACQUIRE );
+#else
+    count = ctx->buffer_count;
+#endif
 
-    for ( bin = context->bins; (void*)bin < memory; bin++ ) {
+    for ( pos = 0; pos < count; pos++ )
 
-        bin->size = sizeof( struct free_header );
-        bin->next = bin;
-        bin->prev = bin;
-    }
+        if ( (char*)memory >= (char*)PTR( ctx->buffers[ pos ].base ) &&
+             (char*)memory <  (char*)PTR( ctx->buffers[ pos ].base ) +
+                                      ctx->buffers[ pos ].size )
+            return 1;
 
-    add_malloc_buffer( memory, size );
+    return 0;
 }
 
+#endif /* MALLOC_THREADS || !NDEBUG */
+
 
 /**
- * Called when current free memory is not enough
+ * Adjusts the live (inuse) chunk count of the buffer containing a chunk
+ * and, when bytes are handed out (or a chunk grows), retires the touched
+ * range from the buffer's pristine-zero watermark
  *
- * @param size  size of the requested memory
+ * The extra tree_header of slack covers the links the bin machinery may
+ * write just past the chunk (a split remainder's free header)
  *
- * @return a pointer to the allocated memory, or NULL if an error ocurred
+ * @param chunk  pointer into the buffer
+ * @param delta  +1 when a chunk leaves the bins, -1 when it returns,
+ *               0 for in-place growth
+ * @param size   bytes from @a chunk on that stop being pristine (0 on
+ *               free, where nothing new is written past the chunk)
  */
-inline static void* out_of_memory ( size_t size ) {
+static void buffer_live ( void* chunk, long delta, size_t size ) {
 
-    size_t total_size, new_size;
-    void   *new_memory;
+    struct malloc_buffer* buffer;
+    char*  dirty;
+    size_t pos;
 
-    if ( !context->external_alloc )
-        return NULL;
+    for ( pos = 0; pos < context->buffer_count; pos++ ) {
 
-    total_size = size + 2 * MIN_INUSE_CHUNK_SIZE;
+        buffer = context->buffers + pos;
 
-    new_memory = context->external_alloc( total_size, &new_size );
+        if ( (char*)chunk >= (char*)PTR( buffer->base ) &&
+             (char*)chunk <  (char*)PTR( buffer->base ) + buffer->size )
+        {
+            buffer->live += (size_t)delta;
 
-    if ( !new_memory || new_size < total_size )
-        return NULL;
+            if ( buffer->clean && size ) {
 
-    add_malloc_buffer( new_memory, new_size );
+                dirty = (char*)chunk + size + sizeof( struct tree_header );
 
-    size -= MIN_INUSE_CHUNK_SIZE;
+                if ( dirty > (char*)PTR( buffer->base ) + buffer->size )
+                    dirty = (char*)PTR( buffer->base ) + buffer->size;
+
+                if ( (char*)PTR( buffer->clean ) < dirty )
+                    buffer->clean = REF( dirty );
+            }
 
-    return malloc( size );
+            return;
+        }
+    }
 }
 
 
 /**
- * Allocs a chunk of memory of a specified size
- *
- * For more info on the algorithm idea, go to
- * http://gee.cs.oswego.edu/dl/html/malloc.html
+ * Looks up the NUMA node of the buffer containing a chunk
  *
- * @param size  size of the memory trying to be allocated (in bytes)
+ * @param chunk  pointer into the buffer
  *
- * @return a pointer to the allocated memory, or NULL if an error ocurred
+ * @return the node id, or -1 if unknown
  */
-void* malloc ( size_t size ) {
+static int buffer_node ( void* chunk ) {
 
-    struct free_header *bin, *chunk;
+    size_t pos;
 
-    size += MIN_INUSE_CHUNK_SIZE;
+    for ( pos = 0; pos < context->buffer_count; pos++ )
 
-    if ( size < MIN_FREE_CHUNK_SIZE )
-        size  = MIN_FREE_CHUNK_SIZE;
+        if ( (char*)chunk >= (char*)PTR( context->buffers[ pos ].base ) &&
+             (char*)chunk <  (char*)PTR( context->buffers[ pos ].base ) +
+                                     context->buffers[ pos ].size )
+
+            return context->buffers[ pos ].node;
+
+    return -1;
+}
+
+
+#ifdef MALLOC_THREADS
+
+/**
+ * Max number of simultaneous memory contexts (i.e. threads)
+ */
+#define MAX_MALLOC_CONTEXTS 64
+
+
+/**
+ * Global registry of every live context, so free can find the owner of a
+ * chunk alloc'ed by another thread
+ */
+static struct memory_context* context_registry[ MAX_MALLOC_CONTEXTS ];
+
+
+/**
+ * Registers a newly created context in the global registry
+ *
+ * @param ctx  memory context to register
+ */
+static void register_context ( struct memory_context* ctx ) {
+
+    struct memory_context* expected;
+    size_t pos;
+
+    for ( pos = 0; pos < MAX_MALLOC_CONTEXTS; pos++ ) {
+
+        expected = NULL;
+
+        if ( __atomic_compare_exchange_n( context_registry + pos, &expected,
+                                          ctx, 0, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED ) )
+            return;
+    }
+
+    /* an unregistered context can't receive remote frees */
+
+    assert( pos < MAX_MALLOC_CONTEXTS );
+}
+
+
+/**
+ * Finds the context owning a given allocation
+ *
+ * @param memory  pointer to allocated memory
+ *
+ * @return a pointer to the owning context, or NULL if no registered context
+ *         owns it
+ */
+static struct memory_context* find_owner_context ( void* memory ) {
+
+    struct memory_context* ctx;
+    size_t pos;
+
+    for ( pos = 0; pos < MAX_MALLOC_CONTEXTS; pos++ ) {
+
+        ctx = __atomic_load_n( context_registry + pos, __ATOMIC_ACQUIRE );
+
+        if ( ctx && context_owns( ctx, memory ) )
+            return ctx;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Pushes an inuse chunk onto the remote free list of its owning context
+ * (multiple producers, so a CAS loop)
+ *
+ * @param ctx     owning memory context
+ * @param header  header of the chunk being freed
+ */
+static void remote_free_push ( struct memory_context* ctx,
+                               struct free_header* header )
+{
+    struct free_header* head = __atomic_load_n( &ctx->remote_free,
+                                                __ATOMIC_RELAXED );
+
+    do {
+        header->next = head;
+
+    } while ( !__atomic_compare_exchange_n( &ctx->remote_free, &head, header,
+                                            0, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED ) );
+}
+
+#endif /* MALLOC_THREADS */
+
+
+/**
+ * Finds the position of the least significant set bit of a (non-zero) word
+ *
+ * @param word  word to scan
+ *
+ * @return the bit position, starting at 0
+ */
+inline static size_t bit_ctz ( unsigned int word ) {
+
+#ifdef __GNUC__
+    return (size_t)__builtin_ctz( word );
+#else
+    size_t pos = 0;
+
+    while ( !( word & 1 ) ) {
+
+        word >>= 1;
+        pos++;
+    }
+
+    return pos;
+#endif
+}
+
+
+/**
+ * Finds the position of the most significant set bit of a (non-zero) word
+ *
+ * @param word  word to scan
+ *
+ * @return the bit position, starting at 0
+ */
+inline static size_t bit_fls ( size_t word ) {
+
+#ifdef __GNUC__
+    return (size_t)( sizeof( unsigned long ) * 8 - 1 ) -
+           (size_t)__builtin_clzl( word );
+#else
+    size_t pos = 0;
+
+    while ( word >>= 1 )
+        pos++;
+
+    return pos;
+#endif
+}
+
+
+/**
+ * Computes the index of the last bin of size <= to a given size
+ *
+ * The bins step by 8 bytes up to 512, so there the map is a shift; above
+ * that, by powers of two (with a handful of irregular bins in between), so
+ * there it follows the size's most significant bit
+ *
+ * @param size  size of the memory (in bytes)
+ *
+ * @return the bin index
+ */
+inline static size_t size_to_bin ( size_t size ) {
+
+#ifdef MALLOC_MAX_HEAP_SIZE
+
+    size_t bin_pos;
+
+    assert( size <= MALLOC_MAX_HEAP_SIZE );
+
+    bin_pos = size <= 512
+                  ? ( size >> 3 ) - 1
+                  : size < 1024
+                        ? ( size < 640 ? ( size < 576 ? (size_t)63
+                                                      : (size_t)64 )
+                                       : ( size < 768 ? (size_t)65
+                                                      : (size_t)66 ) )
+                        : 67 + bit_fls( size ) - 10;
+
+    /* chunks past the last configured bin all live in that bin */
+
+    return bin_pos < BIN_NUMBER ? bin_pos : BIN_NUMBER - 1;
+
+#else
+
+    assert( size < bin_sizes[ BIN_NUMBER - 1 ] );
+
+    if ( size <= 512 )
+        return ( size >> 3 ) - 1;
+
+    if ( size < 1024 )
+        return size < 640 ? ( size < 576 ? 63 : 64 )
+                          : ( size < 768 ? 65 : 66 );
+
+    return 67 + bit_fls( size ) - 10;
+
+#endif
+}
+
+
+/**
+ * Marks a bin as non-empty in the occupancy bitmap
+ *
+ * @param bin_pos  index of the bin
+ */
+inline static void bin_map_set ( size_t bin_pos ) {
+
+    context->bin_map[ bin_pos / 32 ] |= 1u << ( bin_pos % 32 );
+}
+
+
+/**
+ * Marks a bin as empty in the occupancy bitmap
+ *
+ * @param bin_pos  index of the bin
+ */
+inline static void bin_map_clear ( size_t bin_pos ) {
+
+    context->bin_map[ bin_pos / 32 ] &= ~( 1u << ( bin_pos % 32 ) );
+}
+
+
+/**
+ * Finds the first non-empty bin of index >= to a given index
+ *
+ * @param bin_pos  index of the first bin to consider
+ *
+ * @return the bin index, or BIN_NUMBER if every candidate bin is empty
+ */
+inline static size_t next_nonempty_bin ( size_t bin_pos ) {
+
+    unsigned int word;
+    size_t pos = bin_pos / 32;
+
+    word = context->bin_map[ pos ] & ~0u << ( bin_pos % 32 );
+
+    while ( !word ) {
+
+        if ( ++pos >= BIN_MAP_WORDS )
+            return BIN_NUMBER;
+
+        word = context->bin_map[ pos ];
+    }
+
+    return pos * 32 + bit_ctz( word );
+}
+
+
+/**
+ * Invokes the low-memory callback when the free memory accounting just
+ * crossed below the configured threshold
+ *
+ * @param before  free memory before the allocation (in bytes)
+ */
+inline static void check_low_memory ( size_t before ) {
+
+    if ( context->low_callback &&
+         before >= context->low_threshold &&
+         context->free_memory < context->low_threshold )
+
+        context->low_callback( context->free_memory );
+}
+
+
+/**
+ * Hot-path event tracing: when MALLOC_TRACE is on and a tracer ring has
+ * been provided, allocation events append fixed-size binary records to
+ * it (single producer per context, release-published head, optional
+ * 1-in-N sampling). Compiled out entirely otherwise
+ */
+#ifdef MALLOC_TRACE
+
+inline static unsigned long long trace_cycles ( void ) {
+
+#if defined __x86_64__ || defined __i386__
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+static void trace_event ( unsigned int op, void* address, size_t size ) {
+
+    struct malloc_trace_ring*   ring = context->tracer;
+    struct malloc_trace_record* record;
+    size_t head;
+
+    if ( !ring )
+        return;
+
+    if ( ring->sample > 1 ) {
+
+        if ( ++ring->skipped < ring->sample )
+            return;
+
+        ring->skipped = 0;
+    }
+
+    head   = ring->head;
+    record = ring->records + ( head & ( ring->capacity - 1 ) );
+
+    record->timestamp = trace_cycles();
+    record->address   = address;
+    record->size      = size;
+    record->op        = op;
+
+#ifdef MALLOC_THREADS
+    __atomic_store_n( &ring->head, head + 1, __ATOMIC_RELEASE );
+#else
+    ring->head = head + 1;
+#endif
+}
+
+#define TRACE_EVENT( op, address, size ) trace_event( op, address, size )
+
+#else
+
+#define TRACE_EVENT( op, address, size ) ( (void)( address ), (void)( size ) )
+
+#endif /* MALLOC_TRACE */
+
+
+/**
+ * Accounts a successful allocation in the context statistics
+ *
+ * @param memory  pointer to the allocated memory
+ */
+inline static void count_alloc ( void* memory ) {
+
+    struct inuse_header* header = (struct inuse_header*)memory - 1;
+    size_t size = header->size;
+
+#ifdef MALLOC_PROFILE
+    header->tag   = (chunk_field)context->pending_tag;
+    header->stamp = (chunk_field)context->stats.alloc_count;
+#else
+    (void)header;
+#endif
+
+    context->stats.alloc_count++;
+    context->stats.bin_allocs[ size_to_bin( size ) ]++;
+    context->stats.inuse_memory += size;
+
+    if ( context->stats.inuse_memory > context->stats.peak_inuse_memory )
+
+        context->stats.peak_inuse_memory = context->stats.inuse_memory;
+
+    TRACE_EVENT( MALLOC_TRACE_ALLOC, memory, size );
+}
+
+
+/**
+ * Accounts a free in the context statistics
+ *
+ * @param memory  pointer to the freed memory
+ * @param size    size of the freed chunk (in bytes)
+ */
+inline static void count_free ( void* memory, size_t size ) {
+
+    context->stats.free_count++;
+    context->stats.bin_frees[ size_to_bin( size ) ]++;
+    context->stats.inuse_memory -= size;
+
+    TRACE_EVENT( MALLOC_TRACE_FREE, memory, size );
+}
+
+
+/**
+ * Finds the trie root slot for a given (tree-sized) chunk size
+ *
+ * @param size  size of the chunk (in bytes)
+ *
+ * @return a pointer to the root slot
+ */
+inline static struct tree_header** tree_slot ( size_t size ) {
+
+    return context->tree_roots + size_to_bin( size ) - TREE_BIN_MIN;
+}
+
+
+/**
+ * Trie descent keys are as wide as chunk sizes; each level's branch is
+ * the key's top bit
+ */
+typedef chunk_field tree_key_t;
+
+#define TREE_KEY_TOP ( CHUNK_SIZE_BITS )
+
+
+/**
+ * Builds the trie descent key for a size: the bits below the size's top
+ * bit, left-aligned so each level's branch is just the key's top bit
+ *
+ * @param size  size of the chunk (in bytes)
+ *
+ * @return the descent key
+ */
+inline static tree_key_t tree_key ( size_t size ) {
+
+    return (tree_key_t)size << ( TREE_KEY_TOP + 1 - bit_fls( size ) );
+}
+
+
+/**
+ * Inserts a free chunk into the trie of its bin
+ *
+ * Chunks of an already present size join that node's ring at the tail
+ * (keeping the least-recently-used tie break of the list bins)
+ *
+ * @param chunk  pointer to the chunk's tree header
+ */
+static void tree_insert ( struct tree_header* chunk ) {
+
+    struct tree_header** slot = tree_slot( chunk->size );
+    struct tree_header*  node;
+    tree_key_t           key;
+
+    chunk->child[0] = NULL;
+    chunk->child[1] = NULL;
+
+    if ( !*slot ) {
+
+        *slot = REF( chunk );
+
+        chunk->parent = REF( (struct tree_header*)slot );
+        chunk->next   = REF( chunk );
+        chunk->prev   = REF( chunk );
+
+        bin_map_set( size_to_bin( chunk->size ) );
+
+        return;
+    }
+
+    node = PTR( *slot );
+    key  = tree_key( chunk->size );
+
+    for (;;) {
+
+        if ( node->size == chunk->size ) {
+
+            chunk->parent = NULL;
+            chunk->next   = REF( node );
+            chunk->prev   = node->prev;
+
+            PTR( node->prev )->next = REF( chunk );
+            node->prev              = REF( chunk );
+
+            return;
+        }
+
+        if ( !node->child[ key >> TREE_KEY_TOP ] ) {
+
+            node->child[ key >> TREE_KEY_TOP ] = REF( chunk );
+
+            chunk->parent = REF( node );
+            chunk->next   = REF( chunk );
+            chunk->prev   = REF( chunk );
+
+            return;
+        }
+
+        node  = PTR( node->child[ key >> TREE_KEY_TOP ] );
+        key <<= 1;
+    }
+}
+
+
+/**
+ * Removes a free chunk from the trie of its bin, marking the bin as empty
+ * in the occupancy bitmap if it was the last one
+ *
+ * @param chunk  pointer to the chunk's tree header
+ */
+static void tree_remove ( struct tree_header* chunk ) {
+
+    struct tree_header** slot = tree_slot( chunk->size );
+    struct tree_header*  repl;
+
+    if ( !chunk->parent ) {
+
+        /* just a ring member: unlink it and we are done */
+
+        PTR( chunk->prev )->next = chunk->next;
+        PTR( chunk->next )->prev = chunk->prev;
+
+        return;
+    }
+
+    if ( PTR( chunk->next ) != chunk ) {
+
+        /* promote another chunk of the same size to trie node */
+
+        repl = PTR( chunk->next );
+
+        PTR( chunk->prev )->next = chunk->next;
+        PTR( chunk->next )->prev = chunk->prev;
+
+    } else {
+
+        /* no same-size chunk: take a leaf of the subtree as replacement */
+
+        repl = PTR( chunk->child[0] ? chunk->child[0] : chunk->child[1] );
+
+        if ( repl ) {
+
+            while ( repl->child[0] || repl->child[1] )
+
+                repl = PTR( repl->child[0] ? repl->child[0]
+                                           : repl->child[1] );
+
+            PTR( repl->parent )->child[
+                    REF( repl ) == PTR( repl->parent )->child[1] ] = NULL;
+        }
+    }
+
+    if ( repl ) {
+
+        repl->parent   = chunk->parent;
+        repl->child[0] = chunk->child[0];
+        repl->child[1] = chunk->child[1];
+
+        if ( repl->child[0] )
+            PTR( repl->child[0] )->parent = REF( repl );
+
+        if ( repl->child[1] )
+            PTR( repl->child[1] )->parent = REF( repl );
+    }
+
+    if ( PTR( chunk->parent ) == (struct tree_header*)slot ) {
+
+        *slot = REF( repl );
+
+        if ( !repl )
+            bin_map_clear( size_to_bin( chunk->size ) );
+
+    } else
+
+        PTR( chunk->parent )->child[
+                REF( chunk ) == PTR( chunk->parent )->child[1] ] = REF( repl );
+}
+
+
+/**
+ * Finds the best-fitting chunk of memory >= to a given size in a given
+ * trie bin
+ *
+ * When the bin is above the size's own bin every chunk fits, and the
+ * search just tracks the smallest one to keep fragmentation low
+ *
+ * @param bin_pos  index of the (non-empty) trie bin to explore
+ * @param size     size of memory (in bytes)
+ *
+ * @return a pointer to the chunk's tree header, or NULL if no chunk in
+ *         the bin is big enough
+ */
+static struct tree_header* tree_best_fit ( size_t bin_pos, size_t size ) {
+
+    struct tree_header* node = PTR( context->tree_roots[ bin_pos -
+                                                         TREE_BIN_MIN ] );
+    struct tree_header* best = NULL;
+    struct tree_header* rest = NULL;
+    struct tree_header* right;
+    tree_key_t          key;
+
+    if ( bin_pos != size_to_bin( size ) ) {
+
+        /* every chunk fits: follow the smallest-key path */
+
+        for ( best = node; node;
+              node = PTR( node->child[0] ? node->child[0]
+                                         : node->child[1] ) )
+            if ( node->size < best->size )
+                best = node;
+
+        return best;
+    }
+
+    /* descend along the size's key, remembering the closest bigger
+       subtree in case the exact path runs out */
+
+    key = tree_key( size );
+
+    while ( node ) {
+
+        if ( node->size >= size && ( !best || node->size < best->size ) ) {
+
+            best = node;
+
+            if ( node->size == size )
+                return best;
+        }
+
+        right = PTR( node->child[1] );
+        node  = PTR( node->child[ key >> TREE_KEY_TOP ] );
+
+        PREFETCH( node );
+
+        if ( right && right != node )
+            rest = right;
+
+        key <<= 1;
+    }
+
+    for ( node = rest; node;
+          node = PTR( node->child[0] ? node->child[0]
+                                     : node->child[1] ) )
+
+        if ( node->size >= size && ( !best || node->size < best->size ) )
+
+            best = node;
+
+    return best;
+}
+
+
+/**
+ * Finds the first chunk of memory >= to a given size in a given bin
+ *
+ * @param bin   pointer to bin to explore
+ * @param size  size of memory (in bytes)
+ *
+ * @return a pointer to the chunk's free header
+ */
+inline static struct free_header* find_chunk ( struct free_header* bin,
+                                               size_t size )
+{
+    struct free_header* chunk = bin;
+
+    do {
+
+        chunk = PTR( chunk->next );
+
+        /* fetch the next hop while we test this one */
+
+        PREFETCH( PTR( chunk->next ) );
+
+    } while ( chunk != bin && chunk->size < size );
+
+    return chunk;
+}
+
+
+/**
+ * Finds the first chunk of memory > to a given size in a given bin
+ *
+ * Note the use of > instead of >=, like in find_chunk. This version
+ * is used to implement a tie breaking least-recently-used strategy,
+ * which mantains (for some reason) low memory fragmentation
+ *
+ * @param bin   pointer to bin to explore
+ * @param size  size of memory (in bytes)
+ *
+ * @return a pointer to the chunk's free header
+ */
+inline static struct free_header* find_upper_chunk ( struct free_header* bin,
+                                                     size_t size )
+{
+    struct free_header* chunk = bin;
+
+    do {
+
+        chunk = PTR( chunk->next );
+
+        PREFETCH( PTR( chunk->next ) );
+
+    } while ( chunk != bin && chunk->size <= size );
+
+    return chunk;
+}
+
+
+/**
+ * Adds a chunk of memory to the bins
+ *
+ * @param memory  free memory buffer
+ * @param size    free memory buffer size (in bytes)
+ */
+static void add_free_chunk ( void* memory, size_t size ) {
+
+    struct free_header* header;
+    size_t              bin_pos;
+
+    assert( size >= MIN_FREE_CHUNK_SIZE );
+
+    header = memory;
+
+    header->status = FREE_STATUS;
+    header->size   = size;
+
+    PROTECT_HEADER( header );
+
+    context->mutations++;
+
+    context->stats.free_chunk_count++;
+    context->stats.bin_free_chunks[ size_to_bin( size ) ]++;
+
+    if ( size >= TREE_SIZE_MIN )
+
+        tree_insert( (struct tree_header*)header );
+
+    else {
+
+        bin_pos = size_to_bin( size );
+
+        header->next = REF( find_upper_chunk( context->bins + bin_pos,
+                                              size ) );
+        header->prev = PTR( header->next )->prev;
+
+        PTR( header->next )->prev = REF( header );
+        PTR( header->prev )->next = REF( header );
+
+        bin_map_set( bin_pos );
+    }
+
+    set_footer( memory, size );
+}
+
+
+/**
+ * Takes a free chunk out of its bin, marking the bin as empty in the
+ * occupancy bitmap if this was its last chunk
+ *
+ * @param chunk  pointer to the chunk's free header
+ */
+static void unlink_chunk ( struct free_header* chunk ) {
+
+    context->mutations++;
+
+    context->stats.free_chunk_count--;
+    context->stats.bin_free_chunks[ size_to_bin( chunk->size ) ]--;
+
+    if ( chunk->size >= TREE_SIZE_MIN ) {
+
+        tree_remove( (struct tree_header*)chunk );
+
+        return;
+    }
+
+    PTR( chunk->prev )->next = chunk->next;
+    PTR( chunk->next )->prev = chunk->prev;
+
+    /* if only one node remains in the ring, it's the bin head, and the
+       bin is now empty */
+
+    if ( chunk->next == chunk->prev &&
+         PTR( chunk->next ) >= context->bins &&
+         PTR( chunk->next ) <  context->bins + BIN_NUMBER )
+
+        bin_map_clear( (size_t)( PTR( chunk->next ) - context->bins ) );
+}
+
+
+/**
+ * Splits a free chunk of memory in two chunks, the first of a specified size,
+ * and the second goes back to the bins of free chunks
+ *
+ * @param header  pointer to the header of a free memory chunk
+ * @param size    size of the desired chunk
+ *
+ * @return a pointer to the first chunk (which is set "inuse")
+ */
+static void* split_chunk ( struct free_header* header, size_t size ) {
+
+    size_t left_size = header->size - size;
+    size_t before_free;
+
+    if ( left_size < MIN_FREE_CHUNK_SIZE ) {
+
+        size += left_size;
+        left_size = 0;
+
+    } else {
+
+        context->last_chunk = REF( (struct free_header*)( (char*)header +
+                                                           size ) );
+
+        add_free_chunk( (char*)header + size, left_size );
+
+        context->stats.split_count++;
+    }
+
+    header->status = INUSE_STATUS;
+    header->size   = size;
+    header->next   = NULL;
+    header->prev   = NULL;
+
+    PROTECT_HEADER( header );
+
+    set_footer( header, size );
+
+    buffer_live( header, +1, size );
+
+    before_free = context->free_memory;
+
+    context->free_memory    -= size;
+    context->last_chunk_size = left_size;
+
+    check_low_memory( before_free );
+
+    return (struct inuse_header*)header + 1;
+}
+
+
+/**
+ * Adds a new memory area for allocations to the current memory context
+ *
+ * The buffer should be < 2 GB (< 4 EB if MALLOC_BIG_HEAP is on)
+ *
+ * @param memory  memory buffer
+ * @param size    memory buffer size (in bytes)
+ */
+static void add_malloc_buffer_inner ( void* memory, size_t size ) {
+
+    struct bound {
+
+        struct inuse_header header;
+        struct footer       footer;
+
+    } *bound;
+
+    size_t pad;
+
+    /* place the first chunk so payloads come out 16-byte aligned, and
+       make the interior a whole number of 16-byte units */
+
+    pad = (size_t)-( (size_t)memory + sizeof( struct bound ) +
+                     sizeof( struct inuse_header ) ) & 15;
+
+    memory = (char*)memory + pad;
+    size  -= pad;
+
+    if ( size < 2 * sizeof( struct bound ) + ROUND_CHUNK_SIZE(
+                    MIN_FREE_CHUNK_SIZE ) )
+        return;
+
+    size -= ( size - 2 * sizeof( struct bound ) ) % 16;
+
+    context->mutations++;
+
+    context->stats.total_memory += size;
+
+    if ( context->buffer_count < MAX_MALLOC_BUFFERS ) {
+
+        context->buffers[ context->buffer_count ].base  = REF( memory );
+        context->buffers[ context->buffer_count ].size  = size;
+        context->buffers[ context->buffer_count ].live  = 0;
+        context->buffers[ context->buffer_count ].clean = NULL;
+        context->buffers[ context->buffer_count ].node  = -1;
+
+        /* publish the entry before the new count, so a concurrent
+           remote-free scan never sees a half-written entry */
+
+#ifdef MALLOC_THREADS
+        __atomic_store_n( &context->buffer_count, context->buffer_count + 1,
+                          __ATOMIC_RELEASE );
+#else
+        context->buffer_count++;
+#endif
+    }
+
+    bound  = memory;
+
+    bound->header.status = INUSE_STATUS;
+    bound->header.size   = sizeof( struct bound );
+
+    PROTECT_HEADER( &bound->header );
+
+    set_footer( bound, sizeof( struct bound ) );
+
+    bound = (struct bound*)((char*)memory + size) - 1;
+
+    bound->header.status = INUSE_STATUS;
+    bound->header.size   = sizeof( struct bound );
+
+    PROTECT_HEADER( &bound->header );
+
+    set_footer( bound, sizeof( struct bound ) );
+
+    memory = (struct bound*)memory + 1;
+    size  -= 2 * sizeof( struct bound );
+
+    add_free_chunk( memory, size );
+
+    context->free_memory += size;
+}
+
+
+/**
+ * @see the add_malloc_buffer declaration in malloc.h
+ */
+void add_malloc_buffer ( void* memory, size_t size ) {
+
+    CONTEXT_LOCK();
+
+    add_malloc_buffer_inner( memory, size );
+
+    CONTEXT_UNLOCK();
+}
+
+
+/**
+ * Adds a new memory area for allocations, promising that it is zero
+ * filled (e.g. fresh pages from the OS). calloc then skips clearing
+ * memory carved from the area's never-touched tail
+ *
+ * @param memory  memory buffer (all zeros)
+ * @param size    memory buffer size (in bytes)
+ */
+void add_malloc_buffer_zeroed ( void* memory, size_t size ) {
+
+    size_t count = context->buffer_count;
+    char*  clean;
+
+    add_malloc_buffer( memory, size );
+
+    if ( context->buffer_count == count + 1 ) {
+
+        /* everything past the initial free chunk's links is untouched
+           (from the registered, alignment-adjusted base) */
+
+        clean = (char*)PTR( context->buffers[ count ].base ) +
+                MIN_INUSE_CHUNK_SIZE + sizeof( struct tree_header );
+
+        context->buffers[ count ].clean = REF( clean );
+    }
+}
+
+
+/**
+ * Adds a new memory area for allocations, recording the NUMA node it
+ * lives on, so malloc_on_node can restrict placement to it
+ *
+ * @param memory   memory buffer
+ * @param size     memory buffer size (in bytes)
+ * @param node_id  NUMA node of the memory
+ */
+void add_malloc_buffer_node ( void* memory, size_t size, int node_id ) {
+
+    size_t count = context->buffer_count;
+
+    add_malloc_buffer( memory, size );
+
+    if ( context->buffer_count == count + 1 )
+
+        context->buffers[ count ].node = node_id;
+}
+
+
+/**
+ * Creates a new malloc context in the given memory buffer. Uses the remaining
+ * memory for allocations
+ *
+ * Must be called before any malloc or free (unless a memory context has been
+ * set manually). If MALLOC_THREADS is on, it must be called once per thread,
+ * each with its own buffer
+ *
+ * Size must be, at least, sizeof( struct memory_context ) (a few KBs), to
+ * let a memory context fit
+ *
+ * @param memory  memory buffer
+ * @param size    memory buffer size (in bytes)
+ */
+void init_malloc ( void* memory, size_t size ) {
+
+    struct free_header* bin;
+    size_t pos;
+
+    assert( size >= sizeof( struct memory_context ) );
+
+    context = memory;
+    memory  = (struct memory_context*)memory + 1;
+    size   -= sizeof( struct memory_context );
+
+#ifdef MALLOC_SHARED
+    context->lock = 0;
+#endif
+
+    context->free_memory     = 0;
+    context->last_chunk_size = 0;
+    context->external_alloc  = NULL;
+    context->mutations       = 0;
+    context->buffer_count    = 0;
+    context->external_free   = NULL;
+    context->low_threshold   = 0;
+    context->low_callback    = NULL;
+    context->error_handler   = NULL;
+    context->direct_threshold = 0;
+    context->direct_count    = 0;
+    context->magazines_on    = 0;
+    context->fastbins_on     = 0;
+    context->spans_on        = 0;
+    context->span_count      = 0;
+    context->page_size       = 0;
+    context->policy          = MALLOC_POLICY_LOCALITY;
+
+#ifdef MALLOC_PROFILE
+    context->pending_tag = 0;
+#endif
+
+#ifdef MALLOC_TRACE
+    context->tracer = NULL;
+#endif
+
+    for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ ) {
+
+        context->fastbins[ pos ]       = NULL;
+        context->fastbin_counts[ pos ] = 0;
+    }
+
+    memset( &context->stats, 0, sizeof( context->stats ) );
+    context->deferred_on     = 0;
+    context->incoming_bytes  = 0;
+    context->incoming        = NULL;
+
+    for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ )
+
+        context->magazines[ pos ].count = 0;
+
+#ifdef MALLOC_THREADS
+    context->remote_free = NULL;
+
+    register_context( context );
+#endif
+
+    assert( BIN_NUMBER <= TREE_BIN_MIN ||
+            bin_sizes[ BIN_NUMBER <= TREE_BIN_MIN ? 0 : TREE_BIN_MIN ] ==
+                TREE_SIZE_MIN );
+
+    for ( pos = 0; TREE_BIN_MIN + pos < BIN_NUMBER; pos++ )
+
+        context->tree_roots[ pos ] = NULL;
+
+    for ( pos = 0; pos < BIN_MAP_WORDS; pos++ )
+
+        context->bin_map[ pos ] = 0;
+
+    for ( bin = context->bins; (void*)bin < memory; bin++ ) {
+
+        bin->status = FREE_STATUS;
+        bin->size   = sizeof( struct free_header );
+        bin->next   = REF( bin );
+        bin->prev   = REF( bin );
+    }
+
+    add_malloc_buffer( memory, size );
+}
+
+
+static void* malloc_inner ( size_t size );
+
+static void* memalign_inner ( size_t alignment, size_t size );
+
+static struct free_header* take_chunk ( size_t size );
+
+static void* split_chunk ( struct free_header* header, size_t size );
+
+static void local_free ( void* memory );
+
+static void invalid_free ( void* memory );
+
+static size_t largest_free_chunk ( void );
+
+static void add_malloc_buffer_inner ( void* memory, size_t size );
+
+
+/**
+ * Asks the external allocator (if any) for a new memory area able to hold
+ * a chunk of the given size, and adds it to the current context
+ *
+ * @param size  size of the chunk we couldn't fit (in bytes)
+ *
+ * @return 1 if the context grew, 0 if it couldn't
+ */
+inline static int grow_context ( size_t size ) {
+
+    size_t total_size, new_size;
+    void   *new_memory;
+
+    if ( !context->external_alloc )
+        return 0;
+
+    /* besides the two bound chunks, add_malloc_buffer may give up to 15
+       bytes aligning the first payload and 15 more trimming the interior
+       to whole 16-byte units */
+
+    total_size = size + 2 * MIN_INUSE_CHUNK_SIZE + 32;
+
+    context->stats.external_alloc_count++;
+
+    TRACE_EVENT( MALLOC_TRACE_GROW, NULL, size );
+
+    new_memory = context->external_alloc( total_size, &new_size );
+
+    if ( !new_memory || new_size < total_size )
+        return 0;
+
+    add_malloc_buffer_inner( new_memory, new_size );
+
+    return 1;
+}
+
+
+/**
+ * Called when current free memory is not enough: grows the context once
+ * and retries the chunk search once, so a failing or miscounting
+ * external allocator can never be drained by unbounded retries
+ *
+ * @param size  size of the requested chunk, including headers (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+inline static void* out_of_memory ( size_t size ) {
+
+    struct free_header* chunk;
+
+    if ( !grow_context( size ) )
+        return NULL;
+
+    chunk = take_chunk( size );
+
+    if ( !chunk )
+        return NULL;
+
+    return split_chunk( chunk, size );
+}
+
+
+#ifdef MALLOC_THREADS
+
+static void local_free ( void* memory );
+
+
+/**
+ * Frees every chunk other threads pushed onto our remote free list since
+ * the last drain (single consumer, so one atomic swap takes the whole list)
+ */
+static void drain_remote_free ( void ) {
+
+    struct free_header *header, *next;
+
+    if ( !__atomic_load_n( &context->remote_free, __ATOMIC_RELAXED ) )
+        return;
+
+    header = __atomic_exchange_n( &context->remote_free, NULL,
+                                  __ATOMIC_ACQUIRE );
+
+    while ( header ) {
+
+        next = header->next;
+
+        local_free( (struct inuse_header*)header + 1 );
+
+        header = next;
+    }
+}
+
+#endif /* MALLOC_THREADS */
+
+
+/**
+ * Finds a free chunk of memory >= to a given (padded) chunk size and
+ * takes it out of its bin
+ *
+ * @param size  size of the chunk, including headers (in bytes)
+ *
+ * @return a pointer to the chunk's free header, or NULL if no free chunk
+ *         is big enough
+ */
+static struct free_header* take_chunk ( size_t size ) {
+
+    struct free_header *bin, *chunk;
+    size_t bin_pos;
+
+    if ( size > context->free_memory )
+
+        return NULL;
+
+    /* find first non-empty large enough bin */
+
+    bin_pos = next_nonempty_bin( size_to_bin( size ) );
+
+    if ( bin_pos >= BIN_NUMBER )
+
+        return NULL;
+
+    if ( bin_pos < TREE_BIN_MIN )
+        PREFETCH( PTR( context->bins[ bin_pos ].next ) );
+
+    /* find a chunk in that bin; the size's own bin may hold only
+       smaller chunks, in which case move to the next non-empty bin,
+       where anything fits. The bins are size-sorted, so the first fit
+       find_chunk returns is also the best (and the exact) fit; the
+       address-ordered policy walks a bounded window for the lowest
+       address instead */
+
+    if ( bin_pos < TREE_BIN_MIN ) {
+
+        bin = context->bins + bin_pos;
+
+        if ( context->policy == MALLOC_POLICY_ADDRESS ) {
+
+            struct free_header* walk;
+            size_t limit = POLICY_SEARCH_LIMIT;
+
+            chunk = NULL;
+
+            for ( walk = PTR( bin->next ); walk != bin && limit--;
+                  walk = PTR( walk->next ) )
+
+                if ( walk->size >= size && ( !chunk || walk < chunk ) )
+                    chunk = walk;
+
+        } else {
+
+            chunk = find_chunk( bin, size );
+
+            if ( chunk == bin )
+                chunk = NULL;
+        }
+
+    } else
+        chunk = (struct free_header*)tree_best_fit( bin_pos, size );
+
+    if ( !chunk ) {
+
+        bin_pos = next_nonempty_bin( bin_pos + 1 );
+
+        if ( bin_pos >= BIN_NUMBER )
+
+            return NULL;
+
+        if ( bin_pos < TREE_BIN_MIN )
+
+            chunk = PTR( context->bins[ bin_pos ].next );
+        else
+            chunk = (struct free_header*)tree_best_fit( bin_pos, size );
+    }
+
+    /* heuristic to improve locality */
+
+    if ( context->policy == MALLOC_POLICY_LOCALITY &&
+         size <  chunk->size                       &&
+         size <= context->last_chunk_size          &&
+         size <= MAX_SMALL_REQUEST )
+    {
+        chunk = PTR( context->last_chunk );
+    }
+
+    /* take the chunk out of the bin */
+
+    unlink_chunk( chunk );
+
+    return chunk;
+}
+
+
+/**
+ * Allocs a chunk of memory of a specified (padded) chunk size, searching
+ * the bins and splitting the found chunk
+ *
+ * @param size  size of the chunk, including headers (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+static void flush_incoming ( void );
+
+
+static void* alloc_chunk ( size_t size ) {
+
+    struct free_header* chunk = take_chunk( size );
+
+    if ( !chunk && context->incoming ) {
+
+        flush_incoming();
+
+        chunk = take_chunk( size );
+    }
+
+    if ( !chunk )
+        return out_of_memory( size );
+
+    return split_chunk( chunk, size );
+}
+
+
+/**
+ * Finds the direct-allocation table entry of a given pointer
+ *
+ * @param memory  pointer to allocated memory
+ *
+ * @return the table entry, or NULL if the pointer wasn't a direct
+ *         allocation
+ */
+static struct malloc_buffer* find_direct ( void* memory ) {
+
+    size_t pos;
+
+    for ( pos = 0; pos < context->direct_count; pos++ )
+
+        if ( context->direct_allocs[ pos ].base == memory )
+
+            return context->direct_allocs + pos;
+
+    return NULL;
+}
+
+
+/**
+ * Allocs a chunk of memory straight from the external allocator, keeping
+ * multi-megabyte buffers out of the chunk heap entirely; the mapping is
+ * remembered in a small table so free can return it wholesale
+ *
+ * @param size  size of the memory trying to be allocated (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if the direct path
+ *         can't serve it (the caller falls back to the bins)
+ */
+static void* direct_alloc ( size_t size ) {
+
+    struct malloc_buffer* direct;
+    size_t actual;
+    void*  memory;
+
+    if ( context->direct_count >= MAX_DIRECT_ALLOCS )
+        return NULL;
+
+    context->stats.external_alloc_count++;
+
+    memory = context->external_alloc( size, &actual );
+
+    if ( !memory || actual < size )
+        return NULL;
+
+    direct = context->direct_allocs + context->direct_count++;
+
+    direct->base = memory;
+    direct->size = actual;
+
+    context->stats.alloc_count++;
+    context->stats.inuse_memory += actual;
+
+    if ( context->stats.inuse_memory > context->stats.peak_inuse_memory )
+
+        context->stats.peak_inuse_memory = context->stats.inuse_memory;
+
+    TRACE_EVENT( MALLOC_TRACE_ALLOC, memory, actual );
+
+    return memory;
+}
+
+
+/**
+ * Refills a magazine with chunks of a given size class, carved from the
+ * bins, leaving half of the capacity free for future frees
+ *
+ * @param magazine  magazine to refill
+ * @param size      chunk size of the magazine's class (in bytes)
+ */
+static void refill_magazine ( struct magazine* magazine, size_t size ) {
+
+    void* memory;
+
+    while ( magazine->count < MAGAZINE_CAPACITY / 2 ) {
+
+        memory = alloc_chunk( size );
+
+        if ( !memory )
+            return;
+
+        ( (struct inuse_header*)memory - 1 )->size |= CHUNK_CACHED_FLAG;
+
+        magazine->chunks[ magazine->count++ ] = REF(
+                (struct free_header*)( (struct inuse_header*)memory - 1 ) );
+    }
+}
+
+
+/**
+ * Allocs a small object from a span of its size class, creating a new
+ * span (a page-aligned chunk from the regular heap) when none has room
+ *
+ * Only the span's bitmap and counters are touched: the slot itself
+ * stays clean until the caller writes it
+ *
+ * @param size  size of the memory trying to be allocated (in bytes)
+ *
+ * @return a pointer to the slot, or NULL if no span could serve it (the
+ *         caller falls back to the regular path)
+ */
+static void* span_alloc ( size_t size ) {
+
+    struct span* span;
+    size_t class_size = size < 16 ? 16 : ( size + 15 ) & ~(size_t)15;
+    size_t slots = ( SPAN_SIZE - SPAN_HEADER ) / class_size;
+    size_t pos, word, bit;
+
+    for ( pos = 0; pos < context->span_count; pos++ ) {
+
+        span = PTR( context->spans[ pos ] );
+
+        if ( span->class_size == class_size && span->used < slots )
+            break;
+    }
+
+    if ( pos == context->span_count ) {
+
+        if ( context->span_count >= MAX_SPANS )
+            return NULL;
+
+        span = memalign_inner( SPAN_SIZE, SPAN_SIZE );
+
+        if ( !span )
+            return NULL;
+
+        span->class_size = class_size;
+        span->used       = 0;
+
+        /* bits past the last real slot are born "used", so the free-bit
+           scan can never hand out space beyond the span */
+
+        for ( word = 0; word < 8; word++ )
+
+            for ( span->bitmap[ word ] = 0, bit = 0; bit < 32; bit++ )
+
+                if ( word * 32 + bit >= slots )
+                    span->bitmap[ word ] |= 1u << bit;
+
+        context->spans[ context->span_count++ ] = REF( span );
+    }
+
+    for ( word = 0; span->bitmap[ word ] == ~0u; word++ )
+        ;
+
+    bit = bit_ctz( ~span->bitmap[ word ] );
+
+    span->bitmap[ word ] |= 1u << bit;
+    span->used++;
+
+    context->stats.alloc_count++;
+    context->stats.bin_allocs[ size_to_bin( class_size ) ]++;
+
+    TRACE_EVENT( MALLOC_TRACE_ALLOC,
+                 (char*)span + SPAN_HEADER + ( word * 32 + bit ) * class_size,
+                 class_size );
+
+    return (char*)span + SPAN_HEADER + ( word * 32 + bit ) * class_size;
+}
+
+
+/**
+ * Frees a small object back to its span, releasing the span to the
+ * regular heap once its last slot empties
+ *
+ * @param span    span the memory belongs to
+ * @param pos     index of the span in the registry
+ * @param memory  pointer to the slot
+ */
+static void span_free ( struct span* span, size_t pos, void* memory ) {
+
+    size_t offset = (size_t)( (char*)memory - (char*)span ) - SPAN_HEADER;
+    size_t slot   = offset / span->class_size;
+
+    if ( offset % span->class_size ||
+         !( span->bitmap[ slot / 32 ] & 1u << ( slot % 32 ) ) )
+    {
+        invalid_free( memory );
+        return;
+    }
+
+    span->bitmap[ slot / 32 ] &= ~( 1u << ( slot % 32 ) );
+    span->used--;
+
+    context->stats.free_count++;
+    context->stats.bin_frees[ size_to_bin( span->class_size ) ]++;
+
+    TRACE_EVENT( MALLOC_TRACE_FREE, memory, span->class_size );
+
+    if ( !span->used ) {
+
+        context->spans[ pos ] = context->spans[ --context->span_count ];
+
+        local_free( span );
+    }
+}
+
+
+/**
+ * Allocs a chunk of memory of a specified size
+ *
+ * For more info on the algorithm idea, go to
+ * http://gee.cs.oswego.edu/dl/html/malloc.html
+ *
+ * @param size  size of the memory trying to be allocated (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+static void* malloc_inner ( size_t size ) {
+
+    struct magazine* magazine;
+    void* memory = NULL;
+
+#ifdef MALLOC_THREADS
+    drain_remote_free();
+#endif
+
+    if ( context->direct_threshold && size >= context->direct_threshold &&
+         context->external_alloc   && context->external_free )
+    {
+        memory = direct_alloc( size );
+
+        if ( memory )
+            return memory;
+    }
+
+    if ( context->spans_on && size <= SPAN_SLOT_MAX ) {
+
+        memory = span_alloc( size );
+
+        if ( memory )
+            return memory;
+    }
+
+    /* page-or-bigger chunks get carved at page-aligned offsets, so they
+       never straddle an extra page - but it's a preference: the aligned
+       search needs extra contiguous slack, and when that can't be found
+       an unaligned chunk beats a NULL */
+
+    if ( context->page_size && size >= context->page_size ) {
+
+        memory = memalign_inner( context->page_size, size );
+
+        if ( memory )
+            return memory;
+    }
+
+    size += MIN_INUSE_CHUNK_SIZE;
+
+    if ( size < MIN_FREE_CHUNK_SIZE )
+        size  = MIN_FREE_CHUNK_SIZE;
+
+    size = ROUND_CHUNK_SIZE( size );
+
+    if ( size <= MAX_SMALL_REQUEST ) {
+
+        if ( context->fastbins_on &&
+             context->fastbins[ ( size >> 3 ) - 1 ] )
+        {
+            /* cache-hot reuse: the chunk never stopped being inuse, so
+               nothing needs rewriting */
+
+            struct free_header* chunk =
+                    PTR( context->fastbins[ ( size >> 3 ) - 1 ] );
+
+            context->fastbins[ ( size >> 3 ) - 1 ] = chunk->next;
+            context->fastbin_counts[ ( size >> 3 ) - 1 ]--;
+
+            chunk->size &= ~(chunk_field)CHUNK_CACHED_FLAG;
+
+            memory = (struct inuse_header*)chunk + 1;
+
+            count_alloc( memory );
+
+            return memory;
+        }
+
+        if ( context->magazines_on ) {
+
+            magazine = context->magazines + ( size >> 3 ) - 1;
+
+            if ( !magazine->count )
+                refill_magazine( magazine, size );
+
+            if ( magazine->count ) {
+
+                magazine->count--;
+
+                PTR( magazine->chunks[ magazine->count ] )->size &=
+                        ~(chunk_field)CHUNK_CACHED_FLAG;
+
+                memory = (struct inuse_header*)
+                         PTR( magazine->chunks[ magazine->count ] ) + 1;
+            }
+        }
+    }
+
+    if ( !memory )
+        memory = alloc_chunk( size );
+
+    if ( memory )
+        count_alloc( memory );
+
+    return memory;
+}
+
+
+/**
+ * Allocs a chunk of memory of a specified size
+ *
+ * @param size  size of the memory trying to be allocated (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+void* malloc ( size_t size ) {
+
+    void* memory;
+
+    CONTEXT_LOCK();
+
+    memory = malloc_inner( size );
+
+    CONTEXT_UNLOCK();
+
+    return memory;
+}
+
+
+/**
+ * Carves a span of free memory into equally sized inuse chunks, giving
+ * any too-small leftover to the last chunk
+ *
+ * @param chunk   span to carve (already taken out of its bin)
+ * @param size    size of each chunk, including headers (in bytes)
+ * @param chunks  output array of @a count allocated pointers
+ * @param count   number of chunks to carve (chunk must fit them all)
+ */
+static void carve_chunks ( struct free_header* chunk, size_t size,
+                           void** chunks, size_t count )
+{
+    struct free_header* header;
+    size_t total = chunk->size;
+    size_t avail = total;
+    size_t pos, before_free;
+    char*  base  = (char*)chunk;
+
+    assert( avail >= size * count );
+
+    for ( pos = 0; pos < count; pos++ ) {
+
+        header = (struct free_header*)base;
+
+        header->status = INUSE_STATUS;
+        header->size   = size;
+
+        PROTECT_HEADER( header );
+
+        set_footer( base, size );
+
+        chunks[ pos ] = (struct inuse_header*)base + 1;
+
+        base  += size;
+        avail -= size;
+    }
+
+    if ( avail >= MIN_FREE_CHUNK_SIZE ) {
+
+        context->last_chunk      = REF( (struct free_header*)base );
+        context->last_chunk_size = avail;
+
+        add_free_chunk( base, avail );
+
+    } else {
+
+        if ( avail ) {
+
+            /* too small to stand alone: goes to the last carved chunk */
+
+            header = (struct free_header*)( base - size );
+
+            header->size = size + avail;
+
+            set_footer( header, size + avail );
+        }
+
+        context->last_chunk_size = 0;
+    }
+
+    context->mutations++;
+
+    buffer_live( chunk, (long)count, total );
+
+    before_free = context->free_memory;
+
+    context->free_memory -= total - ( avail >= MIN_FREE_CHUNK_SIZE
+                                          ? avail : 0 );
+
+    check_low_memory( before_free );
+}
+
+
+/**
+ * Allocs a batch of equally sized chunks of memory, amortizing the bin
+ * search over the whole batch: a single free span is carved into as many
+ * chunks as it can hold, repeating with smaller spans (and finally plain
+ * mallocs) until the batch is complete
+ *
+ * @param size    size of each chunk (in bytes)
+ * @param chunks  output array of @a count pointers
+ * @param count   number of chunks to allocate
+ *
+ * @return the number of chunks actually allocated (< count if memory ran
+ *         out); the first entries of @a chunks are valid
+ */
+static size_t malloc_batch_inner ( size_t size, void** chunks,
+                                   size_t count ) {
+
+    struct free_header* chunk;
+    size_t done = 0, span;
+    void*  memory;
+
+#ifdef MALLOC_THREADS
+    drain_remote_free();
+#endif
+
+    size += MIN_INUSE_CHUNK_SIZE;
+
+    if ( size < MIN_FREE_CHUNK_SIZE )
+        size  = MIN_FREE_CHUNK_SIZE;
+
+    size = ROUND_CHUNK_SIZE( size );
+
+    /* a size * count overflow would wrap the span request into a tiny
+       one and then carve headers far past the found chunk */
+
+    if ( count && size > (size_t)-1 / count )
+        return 0;
+
+    while ( done < count ) {
+
+        span  = count - done;
+        chunk = NULL;
+
+        while ( span && !( chunk = take_chunk( size * span ) ) )
+            span /= 2;
+
+        if ( chunk ) {
+
+            carve_chunks( chunk, size, chunks + done, span );
+
+            while ( span-- )
+                count_alloc( chunks[ done++ ] );
+
+        } else {
+
+            /* no span at all: the single-chunk path can still flush,
+               coalesce or grow the context */
+
+            memory = malloc_inner( size - MIN_INUSE_CHUNK_SIZE );
+
+            if ( !memory )
+                break;
+
+            chunks[ done++ ] = memory;
+        }
+    }
+
+    return done;
+}
+
+
+/**
+ * @see the malloc_batch declaration in malloc.h
+ */
+size_t malloc_batch ( size_t size, void** chunks, size_t count ) {
+
+    size_t done;
+
+    CONTEXT_LOCK();
+
+    done = malloc_batch_inner( size, chunks, count );
+
+    CONTEXT_UNLOCK();
+
+    return done;
+}
+
+
+/**
+ * Backs the malloc_sized macro: takes the head chunk of the given bin
+ * when it's an exact fit, falling back to a plain malloc otherwise
+ *
+ * The fast path does no size computation at all (the caller folded it at
+ * compile time) and, since an exact fit reuses the chunk as-is, not even
+ * the footer needs rewriting
+ *
+ * @param bin_pos  bin index of the padded chunk size
+ * @param size     padded chunk size (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+static void* malloc_from_bin_inner ( size_t bin_pos, size_t size ) {
+
+    struct free_header *bin, *chunk;
+    size_t before_free;
+
+    assert( MALLOC_CHUNK_OVERHEAD == MIN_INUSE_CHUNK_SIZE );
+    assert( MALLOC_MIN_CHUNK == MIN_FREE_CHUNK_SIZE );
+    assert( bin_pos == size_to_bin( size ) );
+
+#ifdef MALLOC_THREADS
+    drain_remote_free();
+#endif
+
+    if ( bin_pos < TREE_BIN_MIN ) {
+
+        bin   = context->bins + bin_pos;
+        chunk = PTR( bin->next );
+
+        if ( chunk != bin && chunk->size == size ) {
+
+            unlink_chunk( chunk );
+
+            /* if this was the locality-heuristic chunk, the hint must
+               die with it: nothing resets it here, since we bypass
+               split_chunk */
+
+            if ( chunk == PTR( context->last_chunk ) )
+
+                context->last_chunk_size = 0;
+
+            chunk->status = INUSE_STATUS;
+            chunk->next   = NULL;
+            chunk->prev   = NULL;
+
+            PROTECT_HEADER( chunk );
+
+            buffer_live( chunk, +1, size );
+
+            before_free = context->free_memory;
+
+            context->free_memory -= size;
+
+            check_low_memory( before_free );
+
+            count_alloc( (struct inuse_header*)chunk + 1 );
+
+            return (struct inuse_header*)chunk + 1;
+        }
+    }
+
+    return malloc_inner( size - MALLOC_CHUNK_OVERHEAD );
+}
+
+
+/**
+ * @see the malloc_from_bin declaration in malloc.h
+ */
+void* malloc_from_bin ( size_t bin_pos, size_t size ) {
+
+    void* memory;
+
+    CONTEXT_LOCK();
+
+    memory = malloc_from_bin_inner( bin_pos, size );
+
+    CONTEXT_UNLOCK();
+
+    return memory;
+}
+
+
+/**
+ * Allocs a chunk of memory of a specified size, whose address is a
+ * multiple of a specified alignment
+ *
+ * The alignment is carved out of the found chunk: the misaligned prefix
+ * goes back to the bins as its own free chunk, so alignment costs at most
+ * MIN_FREE_CHUNK_SIZE extra bytes instead of up to @a alignment
+ *
+ * @param alignment  required alignment (a power of two)
+ * @param size       size of the memory trying to be allocated (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+static void* memalign_inner ( size_t alignment, size_t size ) {
+
+    struct free_header* chunk;
+    size_t total, search, prefix, chunk_size;
+    char*  payload;
+
+    assert( alignment && !( alignment & ( alignment - 1 ) ) );
+
+    /* every payload is 16-byte aligned already */
+
+    if ( alignment <= 16 )
+        return malloc_inner( size );
+
+#ifdef MALLOC_THREADS
+    drain_remote_free();
+#endif
+
+    total = size + MIN_INUSE_CHUNK_SIZE;
+
+    if ( total < MIN_FREE_CHUNK_SIZE )
+        total = MIN_FREE_CHUNK_SIZE;
+
+    total = ROUND_CHUNK_SIZE( total );
+
+    /* worst case we give back a prefix of almost alignment +
+       MIN_FREE_CHUNK_SIZE bytes */
+
+    search = total + alignment + MIN_FREE_CHUNK_SIZE;
+
+    chunk = take_chunk( search );
+
+    if ( !chunk && context->incoming ) {
+
+        flush_incoming();
+
+        chunk = take_chunk( search );
+    }
+
+    if ( !chunk ) {
+
+        if ( !grow_context( search ) )
+            return NULL;
+
+        chunk = take_chunk( search );
+
+        if ( !chunk )
+            return NULL;
+    }
+
+    payload = (char*)( (struct inuse_header*)chunk + 1 );
+    prefix  = ( alignment - (size_t)payload % alignment ) % alignment;
+
+    /* the prefix must be a whole free chunk; if too small, skip to the
+       next aligned address */
+
+    while ( prefix && prefix < MIN_FREE_CHUNK_SIZE )
+        prefix += alignment;
+
+    if ( prefix ) {
+
+        chunk_size = chunk->size;
+
+        add_free_chunk( chunk, prefix );
+
+        chunk = (struct free_header*)( (char*)chunk + prefix );
+
+        chunk->status = FREE_STATUS;
+        chunk->size   = chunk_size - prefix;
+    }
+
+    payload = split_chunk( chunk, total );
+
+    count_alloc( payload );
+
+    return payload;
+}
+
+
+/**
+ * @see the memalign declaration in malloc.h
+ */
+void* memalign ( size_t alignment, size_t size ) {
+
+    void* memory;
+
+    CONTEXT_LOCK();
+
+    memory = memalign_inner( alignment, size );
+
+    CONTEXT_UNLOCK();
+
+    return memory;
+}
+
+
+/**
+ * Allocs a chunk of memory of a specified size, restricted to buffers
+ * registered on a given NUMA node
+ *
+ * The bin search only considers chunks living in matching buffers, so
+ * DMA and per-socket data can be placed without running one context per
+ * node. There is no fallback: if the node's buffers can't serve the
+ * request the call fails, and the caller decides whether plain malloc
+ * is acceptable
+ *
+ * @param size     size of the memory trying to be allocated (in bytes)
+ * @param node_id  NUMA node the memory must live on
+ *
+ * @return a pointer to the allocated memory, or NULL if no chunk on the
+ *         node is big enough
+ */
+static void* malloc_on_node_inner ( size_t size, int node_id ) {
+
+    struct free_header *bin, *chunk, *found;
+    struct tree_header *node;
+    size_t bin_pos;
+
+#ifdef MALLOC_THREADS
+    drain_remote_free();
+#endif
+
+    size += MIN_INUSE_CHUNK_SIZE;
+
+    if ( size < MIN_FREE_CHUNK_SIZE )
+        size  = MIN_FREE_CHUNK_SIZE;
+
+    size = ROUND_CHUNK_SIZE( size );
 
     if ( size > context->free_memory )
+        return NULL;
+
+    found = NULL;
+
+    for ( bin_pos = next_nonempty_bin( size_to_bin( size ) );
+          bin_pos < BIN_NUMBER && !found;
+          bin_pos = next_nonempty_bin( bin_pos + 1 ) )
+
+        if ( bin_pos < TREE_BIN_MIN ) {
+
+            bin = context->bins + bin_pos;
+
+            for ( chunk = PTR( bin->next ); chunk != bin;
+                  chunk = PTR( chunk->next ) )
+
+                if ( chunk->size >= size &&
+                     buffer_node( chunk ) == node_id )
+                {
+                    found = chunk;
+                    break;
+                }
+
+        } else {
+
+            /* depth-first over the trie (and each node's ring) */
+
+            node = PTR( context->tree_roots[ bin_pos - TREE_BIN_MIN ] );
+
+            while ( node && !found ) {
+
+                struct tree_header* member = node;
+
+                do {
+
+                    if ( member->size >= size &&
+                         buffer_node( member ) == node_id )
+                    {
+                        found = (struct free_header*)member;
+                        break;
+                    }
+
+                    member = PTR( member->next );
+
+                } while ( member != node );
+
+                if ( found )
+                    break;
+
+                if ( node->child[0] )
+
+                    node = PTR( node->child[0] );
+
+                else if ( node->child[1] )
+
+                    node = PTR( node->child[1] );
+
+                else {
+
+                    while ( PTR( node->parent ) != (struct tree_header*)
+                                ( context->tree_roots + bin_pos -
+                                  TREE_BIN_MIN ) &&
+                            ( REF( node ) == PTR( node->parent )->child[1] ||
+                              !PTR( node->parent )->child[1] ) )
+
+                        node = PTR( node->parent );
+
+                    if ( PTR( node->parent ) == (struct tree_header*)
+                             ( context->tree_roots + bin_pos -
+                               TREE_BIN_MIN ) )
+
+                        node = NULL;
+                    else
+                        node = PTR( PTR( node->parent )->child[1] );
+                }
+            }
+        }
+
+    if ( !found )
+        return NULL;
+
+    unlink_chunk( found );
+
+    chunk = split_chunk( found, size );
+
+    count_alloc( chunk );
+
+    return chunk;
+}
+
+
+/**
+ * @see the malloc_on_node declaration in malloc.h
+ */
+void* malloc_on_node ( size_t size, int node_id ) {
+
+    void* memory;
+
+    CONTEXT_LOCK();
+
+    memory = malloc_on_node_inner( size, node_id );
+
+    CONTEXT_UNLOCK();
+
+    return memory;
+}
+
+
+/**
+ * Allocates a chunk of memory large enough for @a count objects that are
+ * @a size bytes each. The allocated memory is filled with 0s
+ *
+ * @param count  number of objects
+ * @param size   size of each object (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+static void* calloc_inner ( size_t count, size_t size ) {
+
+    char*  cleans[ MAX_MALLOC_BUFFERS ];
+    size_t snapshot, total_size, pos;
+    char*  memory;
+    char*  end;
+
+    if ( size && count > (size_t)-1 / size )
+        return NULL;
+
+    total_size = count * size;
+
+    /* snapshot the pristine watermarks: malloc will retire the carved
+       range, but the bytes past the old watermark were OS-zeroed and,
+       payload-wise, malloc writes nothing there */
+
+    snapshot = context->buffer_count;
+
+    for ( pos = 0; pos < snapshot; pos++ )
+
+        cleans[ pos ] = context->buffers[ pos ].clean;
+
+    memory = malloc_inner( total_size );
+
+    if ( !memory )
+        return NULL;
+
+    for ( pos = 0; pos < snapshot; pos++ )
+
+        if ( cleans[ pos ] &&
+             memory >= (char*)PTR( context->buffers[ pos ].base ) &&
+             memory <  (char*)PTR( context->buffers[ pos ].base ) +
+                               context->buffers[ pos ].size )
+        {
+            end = memory + total_size;
+
+            if ( memory < (char*)PTR( cleans[ pos ] ) )
+
+                memset( memory, 0,
+                        end < (char*)PTR( cleans[ pos ] )
+                            ? total_size
+                            : (size_t)( (char*)PTR( cleans[ pos ] ) -
+                                        memory ) );
+
+            return memory;
+        }
+
+    memset( memory, 0, total_size );
+
+    return memory;
+}
+
+
+/**
+ * @see the calloc declaration in malloc.h
+ */
+void* calloc ( size_t count, size_t size ) {
+
+    void* memory;
+
+    CONTEXT_LOCK();
+
+    memory = calloc_inner( count, size );
+
+    CONTEXT_UNLOCK();
+
+    return memory;
+}
+
+
+/**
+ * Returns a piece of allocated memory to the bins of the current context,
+ * coalescing it with its free neighbours
+ *
+ * @param memory  pointer to the memory to be freed
+ */
+static void bin_free ( void* memory ) {
+
+    struct free_header *header, *cont_header;
+    struct footer *footer, *cont_footer;
+    size_t size;
+
+    if ( memory == NULL )
+        return;
+
+    buffer_live( memory, -1, 0 );
+
+    header = (struct free_header*)( (struct inuse_header*)memory - 1 );
+    footer = (struct footer*)( (char*)header + header->size ) - 1;
+    size   = header->size;
+
+    /* Do not try to free the context, or memory we don't own */
+
+    assert( (char*)header + header->size <= (char*)context ||
+            (char*)header                >= (char*)( context + 1 ) );
+
+    assert( context->buffer_count == MAX_MALLOC_BUFFERS ||
+            context_owns( context, memory ) );
+
+    /* Check chunk invariants */
+
+    assert( header->status == INUSE_STATUS );
+    assert( header->size   == footer->size );
+
+    /* Update context */
+
+    context->free_memory += size;
+
+    /* Try to join with previous chunk (trusting its footer only once the
+       canary checks out, when hardening) */
+
+    cont_footer = (struct footer*)header - 1;
+
+    if ( FOOTER_CANARY_OK( cont_footer ) ) {
+
+        cont_header = (struct free_header*)( (char*)header -
+                                             cont_footer->size );
+
+        if ( cont_header->status == FREE_STATUS &&
+             HEADER_CANARY_OK( cont_header ) )
+        {
+            assert( cont_header->size == cont_footer->size );
+
+            unlink_chunk( cont_header );
+
+            size += cont_header->size;
+
+            header = cont_header;
+
+            context->stats.coalesce_count++;
+        }
+    }
+
+    /* Try to join with next chunk */
+
+    cont_header = (struct free_header*)( footer + 1 );
+
+    if ( cont_header->status == FREE_STATUS &&
+         HEADER_CANARY_OK( cont_header ) )
+    {
+        cont_footer = (struct footer*)( (char*)footer + cont_header->size );
+
+        assert( cont_header->size == cont_footer->size );
+
+        unlink_chunk( cont_header );
+
+        size += cont_header->size;
+
+        context->stats.coalesce_count++;
+
+        if ( PTR( context->last_chunk ) == cont_header ) {
+
+            context->last_chunk_size = 0;
+        }
+    }
+
+    add_free_chunk( header, size );
+}
+
+
+/**
+ * Coalesces and re-bins every chunk deferred by free since the last flush
+ *
+ * The incoming chunks are still marked inuse, so freeing one can never
+ * merge it with another chunk still waiting on the list
+ */
+static void flush_incoming ( void ) {
+
+    struct free_header *header, *next;
+
+    header = PTR( context->incoming );
+
+    context->incoming       = NULL;
+    context->incoming_bytes = 0;
+
+    while ( header ) {
+
+        next = PTR( header->next );
+
+        header->size &= ~(chunk_field)CHUNK_CACHED_FLAG;
+
+        bin_free( (struct inuse_header*)header + 1 );
+
+        header = next;
+    }
+}
+
+
+/**
+ * Flushes the deepest (coldest) chunks of a fastbin back to the bins,
+ * keeping at most @a keep hot ones
+ *
+ * @param bin_pos  fastbin size-class index
+ * @param keep     number of chunks to leave cached
+ */
+static void flush_fastbin ( size_t bin_pos, size_t keep ) {
+
+    struct free_header *chunk, *next;
+    size_t pos;
+
+    if ( context->fastbin_counts[ bin_pos ] <= keep )
+        return;
+
+    chunk = PTR( context->fastbins[ bin_pos ] );
+
+    if ( !keep ) {
+
+        context->fastbins[ bin_pos ] = NULL;
+
+    } else {
+
+        for ( pos = 1; pos < keep; pos++ )
+
+            chunk = PTR( chunk->next );
+
+        next        = PTR( chunk->next );
+        chunk->next = NULL;
+        chunk       = next;
+    }
+
+    context->fastbin_counts[ bin_pos ] = keep;
+
+    while ( chunk ) {
+
+        next = PTR( chunk->next );
+
+        chunk->size &= ~(chunk_field)CHUNK_CACHED_FLAG;
+
+        bin_free( (struct inuse_header*)chunk + 1 );
+
+        chunk = next;
+    }
+}
+
+
+/**
+ * Flushes the oldest chunks of a magazine back to the bins
+ *
+ * @param magazine  magazine to flush
+ * @param count     number of chunks to flush
+ */
+static void flush_magazine ( struct magazine* magazine, size_t count ) {
+
+    size_t pos;
+
+    if ( count > magazine->count )
+        count = magazine->count;
+
+    for ( pos = 0; pos < count; pos++ ) {
+
+        PTR( magazine->chunks[ pos ] )->size &=
+                ~(chunk_field)CHUNK_CACHED_FLAG;
+
+        bin_free( (struct inuse_header*)PTR( magazine->chunks[ pos ] ) + 1 );
+    }
+
+    magazine->count -= count;
+
+    for ( pos = 0; pos < magazine->count; pos++ )
+
+        magazine->chunks[ pos ] = magazine->chunks[ pos + count ];
+}
+
+
+/**
+ * Accounts an invalid (wild, stale or double) free: counted, reported to
+ * the error handler if one is set, and otherwise ignored, so a stray
+ * pointer can't re-link an already-linked header and corrupt the bins
+ *
+ * @param memory  the offending pointer
+ */
+static void invalid_free ( void* memory ) {
+
+    context->stats.invalid_free_count++;
+
+    if ( context->error_handler )
+        context->error_handler( memory );
+}
+
+
+/**
+ * Returns a piece of allocated memory to the current context, through the
+ * magazines when they are on and the chunk is small enough
+ *
+ * @param memory  pointer to the memory to be freed
+ */
+static void local_free ( void* memory ) {
+
+    struct free_header*   header;
+    struct magazine*      magazine;
+    struct malloc_buffer* buffer;
+    size_t                size, pos;
+
+    if ( memory == NULL )
+        return;
+
+    if ( context->direct_count ) {
+
+        struct malloc_buffer* direct = find_direct( memory );
+
+        if ( direct ) {
+
+            size = direct->size;
+
+            context->stats.free_count++;
+            context->stats.inuse_memory -= size;
+
+            TRACE_EVENT( MALLOC_TRACE_FREE, memory, size );
+
+            *direct = context->direct_allocs[ --context->direct_count ];
+
+            context->external_free( memory, size );
+
+            return;
+        }
+    }
+
+    if ( context->span_count ) {
+
+        struct span* span = (struct span*)( (size_t)memory &
+                                            ~(size_t)( SPAN_SIZE - 1 ) );
+
+        for ( pos = 0; pos < context->span_count; pos++ )
+
+            if ( PTR( context->spans[ pos ] ) == span ) {
+
+                span_free( span, pos, memory );
+                return;
+            }
+    }
+
+    header = (struct free_header*)( (struct inuse_header*)memory - 1 );
+    size   = header->size;
+
+    /* the coalescing step will look at both neighbours: start fetching
+       the previous footer and the next header now */
+
+    PREFETCH( (struct footer*)header - 1 );
+    PREFETCH( (char*)header + size );
+
+    /* always-on cheap defense: a free must point into a registered
+       buffer, at an inuse chunk of coherent, 16-granular size whose
+       footer agrees - a few compares, no heap walk. Sizes are multiples
+       of 16 since the alignment work, so a stale or wild pointer almost
+       never parses as a valid chunk */
+
+    buffer = NULL;
+
+    for ( pos = 0; pos < context->buffer_count; pos++ )
+
+        if ( (char*)memory >= (char*)PTR( context->buffers[ pos ].base ) &&
+             (char*)memory <  (char*)PTR( context->buffers[ pos ].base ) +
+                                      context->buffers[ pos ].size )
+        {
+            buffer = context->buffers + pos;
+            break;
+        }
+
+    if ( !buffer && context->buffer_count < MAX_MALLOC_BUFFERS ) {
+
+        invalid_free( memory );
+        return;
+    }
+
+    if ( header->status != INUSE_STATUS ||
+         size < MIN_FREE_CHUNK_SIZE || ( size & 15 ) ||
+         ( buffer && (char*)header + size >
+                         (char*)PTR( buffer->base ) + buffer->size ) )
+    {
+        invalid_free( memory );
+        return;
+    }
+
+    if ( ( (struct footer*)( (char*)header + size ) - 1 )->size != size ) {
+
+        invalid_free( memory );
+        return;
+    }
+
+#ifdef MALLOC_HARDEN
+    {
+        struct footer* footer = (struct footer*)( (char*)header + size ) - 1;
+
+        assert( HEADER_CANARY_OK( header ) );
+        assert( FOOTER_CANARY_OK( footer ) );
+
+        /* a chunk with blown canaries is left leaked: freeing through
+           corrupted boundary tags would spread the damage */
+
+        if ( !HEADER_CANARY_OK( header ) || !FOOTER_CANARY_OK( footer ) )
+            return;
+
+        if ( size > sizeof( struct tree_header ) + sizeof( struct footer ) )
+
+            memset( (char*)header + sizeof( struct tree_header ),
+                    POISON_BYTE,
+                    size - sizeof( struct tree_header )
+                         - sizeof( struct footer ) );
+    }
+#endif
+
+    count_free( memory, size );
+
+    if ( context->fastbins_on && size <= MAX_SMALL_REQUEST &&
+         !( size & 7 ) )
+    {
+        header->size |= CHUNK_CACHED_FLAG;
+        header->next  = context->fastbins[ ( size >> 3 ) - 1 ];
+
+        context->fastbins[ ( size >> 3 ) - 1 ] = REF( header );
+
+        if ( ++context->fastbin_counts[ ( size >> 3 ) - 1 ] > FASTBIN_DEPTH )
+
+            flush_fastbin( ( size >> 3 ) - 1, FASTBIN_DEPTH / 2 );
+
+        return;
+    }
+
+    if ( context->magazines_on && size <= MAX_SMALL_REQUEST &&
+         !( size & 7 ) )
+    {
+        magazine = context->magazines + ( size >> 3 ) - 1;
+
+        if ( magazine->count == MAGAZINE_CAPACITY )
+
+            flush_magazine( magazine, MAGAZINE_CAPACITY / 2 );
+
+        header->size |= CHUNK_CACHED_FLAG;
+
+        magazine->chunks[ magazine->count++ ] = REF( header );
+
+        return;
+    }
+
+    if ( context->deferred_on ) {
+
+        header->size |= CHUNK_CACHED_FLAG;
+        header->next  = context->incoming;
+
+        context->incoming        = REF( header );
+        context->incoming_bytes += size;
+
+        /* once the deferred pool rivals the binned free memory, coalesce
+           the whole batch */
+
+        if ( context->incoming_bytes > context->free_memory )
+
+            flush_incoming();
+
+        return;
+    }
+
+    bin_free( memory );
+}
+
+
+/**
+ * Returns a piece of allocated memory
+ *
+ * If MALLOC_THREADS is on and the memory belongs to another thread's
+ * context, it is handed over to that context's remote free list instead
+ * of being freed in place
+ *
+ * @param memory  pointer to the memory to be freed
+ */
+void free ( void* memory ) {
+
+#ifdef MALLOC_THREADS
+
+    struct memory_context* owner;
+
+    if ( memory && ( !context || !context_owns( context, memory ) ) ) {
+
+        owner = find_owner_context( memory );
+
+        if ( owner && owner != context ) {
+
+            remote_free_push( owner,
+                    (struct free_header*)( (struct inuse_header*)memory - 1 ) );
+
+            return;
+        }
+    }
+
+#endif
+
+    CONTEXT_LOCK();
+
+    local_free( memory );
+
+    CONTEXT_UNLOCK();
+}
+
+
+/**
+ * Returns a batch of allocated chunks of memory
+ *
+ * The pointers are freed in address order, so each chunk finds its
+ * already-freed neighbours and the batch coalesces in a single pass.
+ * Note that the array is sorted in place during the call
+ *
+ * @param chunks  array of pointers to free (NULL entries are fine)
+ * @param count   number of pointers in the array
+ */
+void free_batch ( void** chunks, size_t count ) {
+
+    size_t pos, ins;
+    void*  memory;
+
+    for ( pos = 1; pos < count; pos++ ) {
+
+        memory = chunks[ pos ];
+
+        for ( ins = pos; ins && chunks[ ins - 1 ] > memory; ins-- )
+
+            chunks[ ins ] = chunks[ ins - 1 ];
+
+        chunks[ ins ] = memory;
+    }
+
+    for ( pos = 0; pos < count; pos++ )
+
+        free( chunks[ pos ] );
+}
+
+
+/**
+ * Resizes a previouly malloc'ed chunk of memory to a given new size
+ *
+ * @param memory  pointer to the memory to be resized
+ * @param size    new desired size
+ *
+ * @return a pointer to the new chunk (may be different from original), or
+ *         NULL if an error ocurred
+ */
+/**
+ * Splits the tail of an inuse chunk off as its own chunk and frees it
+ *
+ * @param header  header of the chunk to shrink
+ * @param size    new (smaller) chunk size; the difference must be at
+ *                least MIN_FREE_CHUNK_SIZE
+ */
+static void shrink_chunk ( struct inuse_header* header, size_t size ) {
+
+    struct inuse_header* rest;
+    size_t left_size = header->size - size;
+
+    assert( left_size >= MIN_FREE_CHUNK_SIZE );
+
+    header->size = size;
+
+    rest = (struct inuse_header*)( (char*)header + size );
+
+    rest->status = INUSE_STATUS;
+    rest->size   = left_size;
+
+    PROTECT_HEADER( rest );
+
+    set_footer( rest, left_size );
+    set_footer( header, size );
+
+    buffer_live( rest, +1, left_size );
+
+    local_free( rest + 1 );
+}
+
+
+/**
+ * Takes (the unused part of) a free chunk adjacent to a growing one: out
+ * of its bin, out of the free memory accounting, into the caller's bytes
+ *
+ * @param chunk  the free neighbour
+ */
+static void absorb_chunk ( struct free_header* chunk ) {
+
+    unlink_chunk( chunk );
+
+    size_t before_free = context->free_memory;
+
+    context->free_memory        -= chunk->size;
+    context->last_chunk_size     = 0;
+    context->stats.inuse_memory += chunk->size;
+
+    if ( context->stats.inuse_memory > context->stats.peak_inuse_memory )
+
+        context->stats.peak_inuse_memory = context->stats.inuse_memory;
+
+    check_low_memory( before_free );
+}
+
+
+/**
+ * Tries to resize a chunk without moving its memory: shrinking in place,
+ * or growing over the next chunk when it's free and big enough
+ *
+ * @param memory  pointer to the memory to be resized
+ * @param size    new desired chunk size, including headers (in bytes)
+ *
+ * @return @a memory on success, or NULL if the chunk would have to move
+ */
+static void* resize_chunk ( void* memory, size_t size ) {
+
+    struct inuse_header* header;
+    struct footer*       footer;
+    struct free_header*  next_header;
+
+    header = (struct inuse_header*)memory - 1;
+    footer = (struct footer*)( (char*)header + header->size ) - 1;
+
+    assert( header->status == INUSE_STATUS );
+    assert( header->size   == footer->size );
+
+    /* if it fits in the current chunk */
+
+    if ( size <= header->size ) {
+
+        if ( header->size - size >= MIN_FREE_CHUNK_SIZE )
+
+            shrink_chunk( header, size );
+
+        return memory;
+    }
+
+    next_header = (struct free_header*)( footer + 1 );
+
+    /* if it fits in the current and (free) next chunk */
+
+    if ( next_header->status == FREE_STATUS &&
+         header->size + (size_t)next_header->size >= size )
+    {
+        absorb_chunk( next_header );
+
+        header->size += next_header->size;
+
+        set_footer( header, header->size );
+
+        buffer_live( header, 0, header->size );
+
+        if ( header->size - size >= MIN_FREE_CHUNK_SIZE )
+
+            shrink_chunk( header, size );
+
+        return memory;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Releases every registered buffer that no longer holds any live chunk
+ * back through the external release function (set_external_free)
+ *
+ * A buffer is releasable when its interior has coalesced back into one
+ * free chunk; cached chunks (magazines, deferred list) are flushed first
+ * so they don't pin their buffers. The released memory is exactly the
+ * (memory, size) pair that was registered via add_malloc_buffer
+ *
+ * @return the number of bytes given back
+ */
+static size_t malloc_trim_inner ( void ) {
+
+    struct malloc_buffer* buffer;
+    struct free_header*   header;
+    size_t pos, interior, released = 0;
+    void*  base;
+    size_t size;
+
+    if ( !context->external_free )
+        return 0;
+
+    if ( context->incoming )
+        flush_incoming();
+
+    for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ ) {
+
+        flush_fastbin( pos, 0 );
+
+        flush_magazine( context->magazines + pos,
+                        context->magazines[ pos ].count );
+    }
+
+    for ( pos = context->buffer_count; pos--; ) {
+
+        buffer = context->buffers + pos;
+
+        if ( buffer->live )
+            continue;
+
+        interior = buffer->size - 2 * MIN_INUSE_CHUNK_SIZE;
+        header   = (struct free_header*)( (char*)PTR( buffer->base ) +
+                                          MIN_INUSE_CHUNK_SIZE );
+
+        if ( header->status != FREE_STATUS || header->size != interior )
+            continue;
+
+        unlink_chunk( header );
+
+        if ( (char*)PTR( context->last_chunk ) >=
+                 (char*)PTR( buffer->base ) &&
+             (char*)PTR( context->last_chunk ) <
+                 (char*)PTR( buffer->base ) + buffer->size )
+
+            context->last_chunk_size = 0;
+
+        context->free_memory        -= interior;
+        context->stats.total_memory -= buffer->size;
+
+        base = PTR( buffer->base );
+        size = buffer->size;
+
+        released += size;
+
+        *buffer = context->buffers[ --context->buffer_count ];
+
+        context->external_free( base, size );
+    }
+
+    return released;
+}
+
+
+/**
+ * Guarantees that a following burst of allocations totalling up to
+ * @a bytes (including per-chunk overhead) will succeed, by making sure a
+ * single free chunk that big exists: caches are flushed and coalesced
+ * and, failing that, the external allocator is asked to grow the context
+ *
+ * @param bytes  size of the burst to guarantee (in bytes)
+ *
+ * @return 1 if the reservation holds, 0 if the memory isn't there
+ */
+int malloc_reserve ( size_t bytes ) {
+
+    size_t pos;
+    int    ok;
+
+    CONTEXT_LOCK();
+
+    ok = largest_free_chunk() >= bytes;
+
+    if ( !ok ) {
+
+        if ( context->incoming )
+            flush_incoming();
+
+        for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ ) {
+
+            flush_fastbin( pos, 0 );
+
+            flush_magazine( context->magazines + pos,
+                            context->magazines[ pos ].count );
+        }
+
+        ok = largest_free_chunk() >= bytes;
+    }
+
+    if ( !ok && grow_context( bytes ) )
+
+        ok = largest_free_chunk() >= bytes;
+
+    CONTEXT_UNLOCK();
+
+    return ok;
+}
+
+
+/**
+ * Sets a handler invoked whenever free detects an invalid pointer: a
+ * wild free, a double free, or a stale pointer whose chunk tags no
+ * longer cohere. Such frees are counted (see malloc_stats) and ignored
+ * rather than corrupting the heap; the handler is for logging or
+ * crashing on your own terms
+ *
+ * @param handler  function receiving the offending pointer, or NULL
+ */
+void set_malloc_error_handler ( void ( *handler )( void* ) ) {
+
+    context->error_handler = handler;
+}
+
+
+/**
+ * Sets a callback invoked (from inside the allocation that crosses the
+ * line) whenever free memory drops below a threshold, so caches can
+ * shed load before allocations start failing. The callback may free
+ * memory, but must not allocate - and in MALLOC_SHARED builds it must
+ * not touch the allocator at all, since the context lock is held
+ *
+ * @param threshold  free-memory low-water mark (in bytes)
+ * @param callback   function receiving the current free memory, or NULL
+ *                   to disable
+ */
+void set_low_memory_callback ( size_t threshold,
+                               void ( *callback )( size_t ) )
+{
+    context->low_threshold = threshold;
+    context->low_callback  = callback;
+}
+
+
+/**
+ * @see the malloc_trim declaration in malloc.h
+ */
+size_t malloc_trim ( void ) {
+
+    size_t released;
+
+    CONTEXT_LOCK();
+
+    released = malloc_trim_inner();
+
+    CONTEXT_UNLOCK();
+
+    return released;
+}
+
+
+/**
+ * Resizes a previouly malloc'ed chunk of memory to a given new size
+ *
+ * Grows in place whenever the chunk next to it (or, failing that, the
+ * one before it) is free and big enough, so most growing reallocations
+ * cost a footer update or a memmove instead of a full malloc+memcpy+free
+ *
+ * @param memory  pointer to the memory to be resized
+ * @param size    new desired size
+ *
+ * @return a pointer to the new chunk (may be different from original), or
+ *         NULL if an error ocurred
+ */
+static void* realloc_inner ( void* memory, size_t size ) {
+
+    void*                new_memory;
+    struct inuse_header* header;
+    struct free_header*  prev_header;
+    struct footer*       prev_footer;
+    size_t               old_size;
+
+    context->stats.realloc_count++;
+
+    TRACE_EVENT( MALLOC_TRACE_REALLOC, memory, size );
+
+    if ( !memory )
+        return malloc_inner( size );
+
+    if ( context->direct_count ) {
+
+        struct malloc_buffer* direct = find_direct( memory );
+
+        if ( direct ) {
+
+            if ( size <= direct->size )
+                return memory;
+
+            new_memory = malloc_inner( size );
+
+            if ( new_memory ) {
+
+                memcpy( new_memory, memory, direct->size );
+                local_free( memory );
+            }
+
+            return new_memory;
+        }
+    }
+
+    if ( context->span_count ) {
+
+        struct span* span = (struct span*)( (size_t)memory &
+                                            ~(size_t)( SPAN_SIZE - 1 ) );
+        size_t pos;
+
+        for ( pos = 0; pos < context->span_count; pos++ )
+
+            if ( PTR( context->spans[ pos ] ) == span ) {
+
+                /* span slots carry no boundary tags: within the slot's
+                   class nothing moves, growth copies out and frees it */
+
+                if ( size <= span->class_size )
+                    return memory;
+
+                new_memory = malloc_inner( size );
+
+                if ( new_memory ) {
+
+                    memcpy( new_memory, memory, span->class_size );
+
+                    span_free( span, pos, memory );
+                }
+
+                return new_memory;
+            }
+    }
+
+    size += MIN_INUSE_CHUNK_SIZE;
+
+    if ( size < MIN_FREE_CHUNK_SIZE )
+        size  = MIN_FREE_CHUNK_SIZE;
+
+    size = ROUND_CHUNK_SIZE( size );
+
+    if ( resize_chunk( memory, size ) )
+        return memory;
+
+    header   = (struct inuse_header*)memory - 1;
+    old_size = header->size;
+
+    /* if it fits in the current and (free) previous chunk: the live data
+       moves backwards within warm cache lines, and keeps its locality */
+
+    prev_footer = (struct footer*)header - 1;
+    prev_header = (struct free_header*)( (char*)header - prev_footer->size );
+
+    if ( FOOTER_CANARY_OK( prev_footer )    &&
+         prev_header->status == FREE_STATUS &&
+         prev_header->size + old_size >= size )
+    {
+        assert( prev_header->size == prev_footer->size );
+
+        absorb_chunk( prev_header );
+
+        header = (struct inuse_header*)prev_header;
+
+        header->status = INUSE_STATUS;
+        header->size   = prev_header->size + old_size;
+
+        PROTECT_HEADER( header );
+
+        set_footer( header, header->size );
+
+        buffer_live( header, 0, header->size );
+
+        memmove( header + 1, memory, old_size - MIN_INUSE_CHUNK_SIZE );
+
+        if ( header->size - size >= MIN_FREE_CHUNK_SIZE )
+
+            shrink_chunk( header, size );
+
+        return header + 1;
+    }
+
+    /* else use an entirely new chunk */
+
+    size -= MIN_INUSE_CHUNK_SIZE;
+
+    new_memory = malloc_inner( size );
+
+    if ( new_memory ) {
+
+        memcpy( new_memory, memory, old_size - MIN_INUSE_CHUNK_SIZE );
+        local_free( memory );
+    }
+
+    return new_memory;
+}
+
+
+/**
+ * @see the realloc declaration in malloc.h
+ */
+void* realloc ( void* memory, size_t size ) {
+
+    void* new_memory;
+
+    CONTEXT_LOCK();
+
+    new_memory = realloc_inner( memory, size );
+
+    CONTEXT_UNLOCK();
+
+    return new_memory;
+}
+
+
+/**
+ * Resizes a previouly malloc'ed chunk of memory to a given new size, only
+ * if this can be done without moving it
+ *
+ * @param memory  pointer to the memory to be resized
+ * @param size    new desired size
+ *
+ * @return @a memory on success, or NULL if the chunk would have to move
+ *         (the original memory is untouched)
+ */
+static void* realloc_in_place_inner ( void* memory, size_t size ) {
+
+    context->stats.realloc_count++;
+
+    if ( !memory )
+        return NULL;
+
+    if ( context->direct_count ) {
+
+        struct malloc_buffer* direct = find_direct( memory );
+
+        if ( direct )
+
+            return size <= direct->size ? memory : NULL;
+    }
+
+    if ( context->span_count ) {
+
+        struct span* span = (struct span*)( (size_t)memory &
+                                            ~(size_t)( SPAN_SIZE - 1 ) );
+        size_t pos;
+
+        for ( pos = 0; pos < context->span_count; pos++ )
+
+            if ( PTR( context->spans[ pos ] ) == span )
+
+                return size <= span->class_size ? memory : NULL;
+    }
+
+    size += MIN_INUSE_CHUNK_SIZE;
+
+    if ( size < MIN_FREE_CHUNK_SIZE )
+        size  = MIN_FREE_CHUNK_SIZE;
+
+    size = ROUND_CHUNK_SIZE( size );
+
+    return resize_chunk( memory, size );
+}
+
+
+/**
+ * @see the realloc_in_place declaration in malloc.h
+ */
+void* realloc_in_place ( void* memory, size_t size ) {
+
+    void* result;
+
+    CONTEXT_LOCK();
+
+    result = realloc_in_place_inner( memory, size );
+
+    CONTEXT_UNLOCK();
+
+    return result;
+}
+
+
+/**
+ * Checks the integrity of the memory context
+ *
+ * Useful to detect buffer overflows and other memory corruptions
+ *
+ * @return NULL if no error was found, or a pointer to the block where the
+ *         first memory corruption was detected
+ */
+static void* check_malloc_inner ( void ) {
+
+    struct free_header *bin, *block, *last;
+    struct tree_header *node, *member;
+    struct footer *footer;
+    size_t pos;
+    size_t free_memory = context->free_memory;
+
+    for ( bin = context->bins; bin < context->bins + BIN_NUMBER; bin++ ) {
+
+        pos = (size_t)( bin - context->bins );
+
+        if ( bin->status != FREE_STATUS ) {
+
+            /* printf( "Error in context, bin %d\n", bin - context->bins ); */
+            return bin;
+        }
+
+        if ( bin->size != sizeof( struct free_header ) ) {
+
+            /* printf( "Error in context, bin %d\n", bin - context->bins ); */
+            return bin;
+        }
+
+        if ( ( pos < TREE_BIN_MIN
+                   ? bin != PTR( bin->next )
+                   : context->tree_roots[ pos - TREE_BIN_MIN ] != NULL ) !=
+             !!( context->bin_map[ pos / 32 ] & 1u << ( pos % 32 ) ) )
+        {
+            /* printf( "Error in context, bin map %d\n", bin - context->bins ); */
+            return bin;
+        }
+
+        last = bin;
+
+        for ( block = PTR( bin->next ); block != bin;
+              block = PTR( block->next ) ) {
+
+            if ( block->status != FREE_STATUS ) {
+
+                /* printf( "Error in block header\n" ); */
+                return block;
+            }
+
+            if ( PTR( block->prev ) != last ) {
+
+                /* printf( "Error in block header\n" ); */
+                return block;
+            }
+
+            footer = (struct footer*)( (char*)block + block->size ) - 1;
+
+            if ( block->size != footer->size ) {
+
+                /* printf( "Error in block footer\n" ); */
+                return footer;
+            }
+
+            if ( !HEADER_CANARY_OK( block ) || !FOOTER_CANARY_OK( footer ) ) {
+
+                /* printf( "Error in block canary\n" ); */
+                return block;
+            }
+
+            last = block;
+            free_memory -= block->size;
+        }
+    }
+
+    /* walk the trie bins depth-first, using the parent links */
+
+    for ( pos = TREE_BIN_MIN; pos < BIN_NUMBER; pos++ ) {
+
+        node = PTR( context->tree_roots[ pos - TREE_BIN_MIN ] );
+
+        if ( node && PTR( node->parent ) != (struct tree_header*)
+                 ( context->tree_roots + pos - TREE_BIN_MIN ) )
+        {
+            /* printf( "Error in trie root %d\n", pos ); */
+            return node;
+        }
+
+        while ( node ) {
+
+            if ( node->status != FREE_STATUS ||
+                 size_to_bin( node->size ) != pos )
+            {
+                /* printf( "Error in trie node header\n" ); */
+                return node;
+            }
 
-        return out_of_memory( size );
+            footer = (struct footer*)( (char*)node + node->size ) - 1;
+
+            if ( node->size != footer->size ) {
+
+                /* printf( "Error in trie node footer\n" ); */
+                return footer;
+            }
+
+            if ( !HEADER_CANARY_OK( node ) || !FOOTER_CANARY_OK( footer ) ) {
+
+                /* printf( "Error in trie node canary\n" ); */
+                return node;
+            }
+
+            if ( node->child[0] &&
+                 PTR( PTR( node->child[0] )->parent ) != node )
+                return PTR( node->child[0] );
+
+            if ( node->child[1] &&
+                 PTR( PTR( node->child[1] )->parent ) != node )
+                return PTR( node->child[1] );
+
+            free_memory -= node->size;
+
+            for ( member = PTR( node->next ); member != node;
+                  member = PTR( member->next ) )
+            {
+                if ( member->status != FREE_STATUS || member->parent ||
+                     member->size != node->size ||
+                     PTR( member->next )->prev != REF( member ) )
+                {
+                    /* printf( "Error in trie ring member\n" ); */
+                    return member;
+                }
+
+                footer = (struct footer*)( (char*)member + member->size ) - 1;
+
+                if ( member->size != footer->size ) {
+
+                    /* printf( "Error in trie ring member footer\n" ); */
+                    return footer;
+                }
+
+                free_memory -= member->size;
+            }
+
+            if ( node->child[0] )
+
+                node = PTR( node->child[0] );
+
+            else if ( node->child[1] )
+
+                node = PTR( node->child[1] );
+
+            else {
+
+                while ( PTR( node->parent ) != (struct tree_header*)
+                            ( context->tree_roots + pos - TREE_BIN_MIN ) &&
+                        ( REF( node ) == PTR( node->parent )->child[1] ||
+                          !PTR( node->parent )->child[1] ) )
+
+                    node = PTR( node->parent );
+
+                if ( PTR( node->parent ) == (struct tree_header*)
+                         ( context->tree_roots + pos - TREE_BIN_MIN ) )
+
+                    node = NULL;
+                else
+                    node = PTR( PTR( node->parent )->child[1] );
+            }
+        }
+    }
+
+    /* chunks deferred by free are still inuse, but their tags must be
+       coherent */
+
+    for ( node = (struct tree_header*)PTR( context->incoming ); node;
+          node = PTR( node->next ) )
+    {
+        size_t cached = node->size & ~(size_t)CHUNK_CACHED_FLAG;
+
+        if ( node->status != INUSE_STATUS ) {
+
+            /* printf( "Error in deferred chunk header\n" ); */
+            return node;
+        }
+
+        footer = (struct footer*)( (char*)node + cached ) - 1;
+
+        if ( cached != footer->size ) {
+
+            /* printf( "Error in deferred chunk footer\n" ); */
+            return footer;
+        }
+    }
+
+    if ( free_memory ) {
+
+        /* printf( "Error in context, free memory amount inconcistency\n" ); */
+        return context;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @see the check_malloc declaration in malloc.h
+ */
+void* check_malloc ( void ) {
+
+    void* error;
+
+    CONTEXT_LOCK();
+
+    error = check_malloc_inner();
+
+    CONTEXT_UNLOCK();
+
+    return error;
+}
+
+
+/**
+ * Checks that a boundary-tag position parses as a coherent chunk lying
+ * inside [base, end)
+ *
+ * @param chunk  candidate chunk start
+ * @param end    end of the buffer
+ *
+ * @return 1 if coherent, 0 otherwise
+ */
+static int chunk_coherent ( char* chunk, char* end ) {
+
+    struct inuse_header* header = (struct inuse_header*)chunk;
+    struct footer*       footer;
+    size_t               size;
+
+    if ( chunk + MIN_INUSE_CHUNK_SIZE > end )
+        return 0;
+
+    size = header->size & ~(size_t)CHUNK_CACHED_FLAG;
+
+    if ( size < MIN_INUSE_CHUNK_SIZE || chunk + size > end )
+        return 0;
+
+    footer = (struct footer*)( chunk + size ) - 1;
+
+    if ( footer->size != size )
+        return 0;
+
+    if ( !HEADER_CANARY_OK( header ) || !FOOTER_CANARY_OK( footer ) )
+        return 0;
+
+    return 1;
+}
+
+
+/**
+ * Validates a slice of the heap, at most @a budget chunks, resuming from
+ * (and updating) the given cursor
+ *
+ * @param cursor  walk position, updated in place
+ * @param budget  max number of chunks to validate in this call
+ *
+ * @return NULL if no error was found, or a pointer to the place where
+ *         the first memory corruption was detected
+ */
+static void* check_malloc_step_inner ( struct malloc_check_cursor* cursor,
+                                       size_t budget ) {
+
+    struct free_header* block;
+    char *base, *end, *chunk;
+
+    while ( budget ) {
+
+        if ( cursor->buffer >= context->buffer_count ) {
+
+            /* full cycle done: rewind for the next one */
+
+            cursor->buffer = 0;
+            cursor->offset = 0;
+
+            return NULL;
+        }
+
+        base = PTR( context->buffers[ cursor->buffer ].base );
+        end  = base + context->buffers[ cursor->buffer ].size;
+
+        /* if the heap changed under a parked cursor, the offset may no
+           longer be a chunk boundary - and a stale boundary can still
+           parse as a coherent chunk, so coherence probing isn't enough:
+           any structural mutation since the cursor parked restarts the
+           buffer rather than resuming desynchronized */
+
+        if ( cursor->offset && cursor->stamp != context->mutations )
+
+            cursor->offset = 0;
+
+        cursor->stamp = context->mutations;
+
+        chunk = base + cursor->offset;
+
+        while ( budget && chunk < end ) {
+
+            if ( !chunk_coherent( chunk, end ) )
+                return chunk;
+
+            block = (struct free_header*)chunk;
+
+            if ( block->status == FREE_STATUS &&
+                 ( PTR( block->next )->prev != REF( block ) ||
+                   PTR( block->prev )->next != REF( block ) ) )
+                return block;
+
+            chunk += block->size & ~(size_t)CHUNK_CACHED_FLAG;
+            budget--;
+
+            cursor->offset = (size_t)( chunk - base );
+        }
+
+        if ( chunk >= end ) {
+
+            cursor->buffer++;
+            cursor->offset = 0;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @see the check_malloc_step declaration in malloc.h
+ */
+void* check_malloc_step ( struct malloc_check_cursor* cursor, size_t budget ) {
+
+    void* error;
+
+    CONTEXT_LOCK();
+
+    error = check_malloc_step_inner( cursor, budget );
+
+    CONTEXT_UNLOCK();
+
+    return error;
+}
+
+
+/**
+ * Computes the size of the biggest free chunk, from the highest non-empty
+ * bin: the tail of a (sorted) list bin, or the right spine's maximum in a
+ * trie bin
+ *
+ * @return the size (in bytes), or 0 if there is no free chunk
+ */
+static size_t largest_free_chunk ( void ) {
+
+    struct tree_header* node;
+    size_t best, pos = BIN_MAP_WORDS;
+
+    while ( pos-- )
+
+        if ( context->bin_map[ pos ] ) {
+
+            pos = pos * 32 + bit_fls( context->bin_map[ pos ] );
+
+            if ( pos < TREE_BIN_MIN )
+
+                return PTR( context->bins[ pos ].prev )->size;
+
+            best = 0;
+
+            for ( node = PTR( context->tree_roots[ pos - TREE_BIN_MIN ] );
+                  node;
+                  node = PTR( node->child[1] ? node->child[1]
+                                             : node->child[0] ) )
+
+                if ( node->size > best )
+                    best = node->size;
+
+            return best;
+        }
+
+    return 0;
+}
+
+
+/**
+ * Fills a snapshot of the current context's allocation statistics
+ *
+ * @param stats  output statistics
+ */
+static void malloc_stats_inner ( struct malloc_stats* stats ) {
+
+    size_t pos;
+
+    assert( MALLOC_BIN_NUMBER == BIN_NUMBER );
+
+    *stats = context->stats;
+
+    stats->free_memory        = context->free_memory;
+    stats->largest_free_chunk = largest_free_chunk();
+    stats->reclaimable_memory = 0;
+
+    for ( pos = 0; pos < context->buffer_count; pos++ )
+
+        if ( !context->buffers[ pos ].live )
+
+            stats->reclaimable_memory += context->buffers[ pos ].size;
+}
+
+
+/**
+ * @see the malloc_stats declaration in malloc.h
+ */
+void malloc_stats ( struct malloc_stats* stats ) {
+
+    CONTEXT_LOCK();
+
+    malloc_stats_inner( stats );
+
+    CONTEXT_UNLOCK();
+}
+
+
+#ifdef MALLOC_PROFILE
+
+/**
+ * Allocs a chunk of memory of a specified size, tagging it with a
+ * caller-provided allocation-site id that malloc_census later reports
+ *
+ * @param size  size of the memory trying to be allocated (in bytes)
+ * @param tag   allocation-site id (0 is what plain malloc uses)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+void* malloc_tagged ( size_t size, size_t tag ) {
+
+    void* memory;
+
+    CONTEXT_LOCK();
+
+    context->pending_tag = tag;
+
+    memory = malloc_inner( size );
+
+    context->pending_tag = 0;
+
+    CONTEXT_UNLOCK();
+
+    return memory;
+}
+
+
+/**
+ * Walks the boundary tags of every registered buffer and reports each
+ * live chunk - tag, chunk size, age in allocations - to the callback,
+ * without stopping the world for longer than the walk itself
+ *
+ * Chunks cached by the magazines/fastbins/deferred list still count as
+ * live here (flush them first for an exact picture), and the callback
+ * must not allocate
+ *
+ * @param callback  called as callback( tag, size, age, memory ) per
+ *                  live chunk
+ */
+void malloc_census ( void ( *callback )( size_t tag, size_t size,
+                                         size_t age, void* memory ) )
+{
+    struct inuse_header* header;
+    char  *base, *end, *chunk;
+    size_t pos, size;
+
+    CONTEXT_LOCK();
+
+    for ( pos = 0; pos < context->buffer_count; pos++ ) {
+
+        base = PTR( context->buffers[ pos ].base );
+        end  = base + context->buffers[ pos ].size;
+
+        for ( chunk = base; chunk < end; chunk += size ) {
+
+            header = (struct inuse_header*)chunk;
+            size   = header->size & ~(size_t)CHUNK_CACHED_FLAG;
+
+            /* skip the two bound sentinels, free chunks, and chunks
+               parked in a cache (already freed, caller-wise) */
+
+            if ( chunk == base || chunk + size >= end ||
+                 header->status != INUSE_STATUS ||
+                 ( header->size & CHUNK_CACHED_FLAG ) )
+                continue;
+
+            callback( (size_t)header->tag, size,
+                      (size_t)(chunk_field)
+                          ( (chunk_field)context->stats.alloc_count -
+                            header->stamp ),
+                      header + 1 );
+        }
+    }
+
+    CONTEXT_UNLOCK();
+}
+
+#endif /* MALLOC_PROFILE */
+
+
+/**
+ * Get a pointer with all malloc data, including all data-structures containing
+ * the free chunks of memory
+ *
+ * Usefull when several separate malloc contexts are needed
+ *
+ * @return pointer to current context
+ */
+void* get_malloc_context ( void ) {
+
+    return context;
+}
+
+
+#ifndef MALLOC_SHARED
+
+/**
+ * Pointer <-> context-relative-offset conversion for freeze/thaw. NULL
+ * maps to NULL (no internal pointer ever targets the context base, so
+ * the encoding is unambiguous). With MALLOC_SHARED the heap already
+ * lives in offset form, so freezing is just quiescing
+ */
+#define PTR_TO_OFF( ptr ) \
+    ( (ptr) ? (char*)0 + ( (char*)(ptr) - (char*)context ) : NULL )
+
+#define OFF_TO_PTR( off ) \
+    ( (off) ? (char*)context + ( (char*)(off) - (char*)0 ) : NULL )
+
+
+/**
+ * Converts a trie subtree (rings included) to offset form, bottom-up so
+ * the links are still walkable on the way down
+ *
+ * @param node  subtree root (still a real pointer)
+ */
+static void freeze_tree ( struct tree_header* node ) {
+
+    struct tree_header *member, *next, *child0, *child1;
+
+    member = node->next;
+
+    while ( member != node ) {
+
+        next = member->next;
+
+        member->next = (struct tree_header*)PTR_TO_OFF( member->next );
+        member->prev = (struct tree_header*)PTR_TO_OFF( member->prev );
+
+        member = next;
+    }
+
+    node->next = (struct tree_header*)PTR_TO_OFF( node->next );
+    node->prev = (struct tree_header*)PTR_TO_OFF( node->prev );
+
+    child0 = node->child[0];
+    child1 = node->child[1];
+
+    if ( child0 )
+        freeze_tree( child0 );
+
+    if ( child1 )
+        freeze_tree( child1 );
+
+    node->child[0] = (struct tree_header*)PTR_TO_OFF( child0 );
+    node->child[1] = (struct tree_header*)PTR_TO_OFF( child1 );
+    node->parent   = (struct tree_header*)PTR_TO_OFF( node->parent );
+}
+
+
+/**
+ * Converts a trie subtree (rings included) back to pointer form, top-down
+ *
+ * @param node  subtree root (already a real pointer, links still offsets)
+ */
+static void thaw_tree ( struct tree_header* node ) {
+
+    struct tree_header* member;
+
+    node->next     = (struct tree_header*)OFF_TO_PTR( node->next );
+    node->prev     = (struct tree_header*)OFF_TO_PTR( node->prev );
+    node->child[0] = (struct tree_header*)OFF_TO_PTR( node->child[0] );
+    node->child[1] = (struct tree_header*)OFF_TO_PTR( node->child[1] );
+    node->parent   = (struct tree_header*)OFF_TO_PTR( node->parent );
+
+    for ( member = node->next; member != node; member = member->next ) {
+
+        member->next = (struct tree_header*)OFF_TO_PTR( member->next );
+        member->prev = (struct tree_header*)OFF_TO_PTR( member->prev );
+    }
+
+    if ( node->child[0] )
+        thaw_tree( node->child[0] );
+
+    if ( node->child[1] )
+        thaw_tree( node->child[1] );
+}
+
+
+#endif /* !MALLOC_SHARED */
+
+
+/**
+ * Quiesces the current context and converts every internal pointer (bin
+ * rings, trie links, buffer registry, locality hint) to an offset from
+ * the context base, so the whole heap - context and registered buffers,
+ * which must share one contiguous mapping or move together - can be
+ * persisted or remapped and rebound elsewhere with malloc_thaw
+ *
+ * The magazines, fastbins and deferred list are flushed first. Function
+ * pointers (external allocator/releaser, tracer) can't survive a
+ * relocation and are cleared; live direct allocations can't be frozen.
+ * The current context becomes NULL until a thaw installs one
+ */
+void malloc_freeze ( void ) {
 
-    /* find first non-empty large enough bin */
+#ifndef MALLOC_SHARED
+    struct free_header *bin, *chunk, *next;
+#endif
+    size_t pos;
 
-    for ( bin = find_bin( size ); bin == bin->next; )
+    assert( context->direct_count == 0 );
 
-        if ( ++bin >= context->bins + BIN_NUMBER )
+    if ( context->incoming )
+        flush_incoming();
 
-            return out_of_memory( size );
+    for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ ) {
 
-    /* find first large enough chunk */
+        flush_fastbin( pos, 0 );
 
-    chunk = find_chunk( bin, size );
+        flush_magazine( context->magazines + pos,
+                        context->magazines[ pos ].count );
+    }
 
-    if ( chunk == bin ) {
+#ifdef MALLOC_THREADS
+    drain_remote_free();
+#endif
 
-        for ( bin++; bin == bin->next; )
+    context->external_alloc = NULL;
+    context->external_free  = NULL;
 
-            if ( ++bin >= context->bins + BIN_NUMBER )
+#ifdef MALLOC_TRACE
+    context->tracer = NULL;
+#endif
 
-                return out_of_memory( size );
+#ifndef MALLOC_SHARED
 
+    for ( bin = context->bins;
+          bin < context->bins + BIN_NUMBER; bin++ )
+    {
         chunk = bin->next;
-    }
 
-    /* heuristic to improve locality */
+        while ( chunk != bin ) {
 
-    if ( size <  chunk->size              &&
-         size <= context->last_chunk_size &&
-         size <= MAX_SMALL_REQUEST )
-    {
-        chunk = context->last_chunk;
+            next = chunk->next;
+
+            chunk->next = (struct free_header*)PTR_TO_OFF( chunk->next );
+            chunk->prev = (struct free_header*)PTR_TO_OFF( chunk->prev );
+
+            chunk = next;
+        }
+
+        bin->next = (struct free_header*)PTR_TO_OFF( bin->next );
+        bin->prev = (struct free_header*)PTR_TO_OFF( bin->prev );
     }
 
-    /* take the chunk out of the bin */
+    for ( pos = 0; pos < BIN_NUMBER - TREE_BIN_MIN; pos++ )
 
-    chunk->prev->next = chunk->next;
-    chunk->next->prev = chunk->prev;
+        if ( context->tree_roots[ pos ] ) {
 
-    return split_chunk( chunk, size );
-}
+            freeze_tree( context->tree_roots[ pos ] );
+
+            context->tree_roots[ pos ] = (struct tree_header*)
+                    PTR_TO_OFF( context->tree_roots[ pos ] );
+        }
 
+    context->last_chunk = (struct free_header*)
+            PTR_TO_OFF( context->last_chunk );
 
-/**
- * Allocates a chunk of memory large enough for @a count objects that are
- * @a size bytes each. The allocated memory is filled with 0s
- *
- * @param count  number of objects
- * @param size   size of each object (in bytes)
- *
- * @return a pointer to the allocated memory, or NULL if an error ocurred
- */
-void* calloc ( size_t count, size_t size ) {
+    /* spans hold live caller slots, so they can't be flushed like the
+       other caches: their registry relocates instead */
 
-    size_t total_size = count * size;
-    void*  memory     = malloc( total_size );
+    for ( pos = 0; pos < context->span_count; pos++ )
 
-    if ( memory )
-        memset( memory, 0, total_size );
+        context->spans[ pos ] = (struct span*)
+                PTR_TO_OFF( context->spans[ pos ] );
 
-    return memory;
+    for ( pos = 0; pos < context->buffer_count; pos++ ) {
+
+        context->buffers[ pos ].base  = PTR_TO_OFF( context->buffers[ pos ].base );
+        context->buffers[ pos ].clean = (char*)
+                PTR_TO_OFF( context->buffers[ pos ].clean );
+    }
+
+#endif /* !MALLOC_SHARED */
+
+    context = NULL;
 }
 
 
 /**
- * Returns a piece of allocated memory
+ * Rebinds a frozen heap mapped at (a possibly different) @a base: every
+ * offset is turned back into a pointer and the context becomes current
  *
- * @param memory  pointer to the memory to be freed
+ * The external allocator, releaser and tracer must be re-set by the
+ * caller if wanted
+ *
+ * @param base  address the frozen context is mapped at
+ *
+ * @return the thawed context (also installed as current)
  */
-void free ( void* memory ) {
-
-    struct free_header *header, *cont_header;
-    struct footer *footer, *cont_footer;
-    size_t size;
+void* malloc_thaw ( void* base ) {
 
-    if ( memory == NULL )
-        return;
+#ifndef MALLOC_SHARED
+    struct free_header *bin, *chunk;
+    size_t pos;
+#endif
 
-    header = (struct free_header*)( (struct inuse_header*)memory - 1 );
-    footer = (struct footer*)( (char*)header + header->size ) - 1;
-    size   = header->size;
+    context = base;
 
-    /* Do not try to free the context */
+#ifndef MALLOC_SHARED
 
-    assert( (char*)header + header->size <= (char*)context ||
-            (char*)header                >= (char*)( context + 1 ) );
+    for ( bin = context->bins;
+          bin < context->bins + BIN_NUMBER; bin++ )
+    {
+        bin->next = (struct free_header*)OFF_TO_PTR( bin->next );
+        bin->prev = (struct free_header*)OFF_TO_PTR( bin->prev );
 
-    /* Check chunk invariants */
+        for ( chunk = bin->next; chunk != bin; chunk = chunk->next ) {
 
-    assert( header->status == INUSE_STATUS );
-    assert( header->size   == footer->size );
+            chunk->next = (struct free_header*)OFF_TO_PTR( chunk->next );
+            chunk->prev = (struct free_header*)OFF_TO_PTR( chunk->prev );
+        }
+    }
 
-    /* Update context */
+    for ( pos = 0; pos < BIN_NUMBER - TREE_BIN_MIN; pos++ )
 
-    context->free_memory += size;
+        if ( context->tree_roots[ pos ] ) {
 
-    /* Try to join with previous chunk */
+            context->tree_roots[ pos ] = (struct tree_header*)
+                    OFF_TO_PTR( context->tree_roots[ pos ] );
 
-    cont_footer = (struct footer*)header - 1;
-    cont_header = (struct free_header*)( (char*)header - cont_footer->size );
+            thaw_tree( context->tree_roots[ pos ] );
+        }
 
-    if ( cont_header->status == FREE_STATUS ) {
+    context->last_chunk = (struct free_header*)
+            OFF_TO_PTR( context->last_chunk );
 
-        assert( cont_header->size == cont_footer->size );
+    for ( pos = 0; pos < context->span_count; pos++ )
 
-        cont_header->prev->next = cont_header->next;
-        cont_header->next->prev = cont_header->prev;
+        context->spans[ pos ] = (struct span*)
+                OFF_TO_PTR( context->spans[ pos ] );
 
-        size += cont_header->size;
+    for ( pos = 0; pos < context->buffer_count; pos++ ) {
 
-        header = cont_header;
+        context->buffers[ pos ].base  = OFF_TO_PTR( context->buffers[ pos ].base );
+        context->buffers[ pos ].clean = (char*)
+                OFF_TO_PTR( context->buffers[ pos ].clean );
     }
 
-    /* Try to join with next chunk */
+#endif /* !MALLOC_SHARED */
 
-    cont_header = (struct free_header*)( footer + 1 );
-    cont_footer = (struct footer*)( (char*)footer + cont_header->size );
+    return context;
+}
 
-    if ( cont_header->status == FREE_STATUS ) {
 
-        assert( cont_header->size == cont_footer->size );
+/**
+ * Set the current context to a previously gotten context
+ *
+ * @param context pointer to a context
+ */
+void set_malloc_context ( void* new_context ) {
 
-        cont_header->prev->next = cont_header->next;
-        cont_header->next->prev = cont_header->prev;
+    context = new_context;
+}
 
-        size += cont_header->size;
 
-        if ( context->last_chunk == cont_header ) {
+/**
+ * Creates a new arena (an independent memory context) in the given memory
+ * buffer, without disturbing the current context
+ *
+ * @param memory  memory buffer
+ * @param size    memory buffer size (in bytes)
+ *
+ * @return the arena, or NULL if the buffer can't fit one
+ */
+void* malloc_arena_create ( void* memory, size_t size ) {
+
+    struct memory_context* saved = context;
+    void* arena;
 
-            context->last_chunk_size = 0;
-        }
-    }
+    if ( size < sizeof( struct memory_context ) + MIN_FREE_CHUNK_SIZE )
+        return NULL;
 
-    add_free_chunk( header, size );
+    init_malloc( memory, size );
+
+    arena = context;
+    context = saved;
+
+    return arena;
 }
 
 
 /**
- * Resizes a previouly malloc'ed chunk of memory to a given new size
+ * Allocs a chunk of memory of a specified size from a given arena
  *
- * @param memory  pointer to the memory to be resized
- * @param size    new desired size
+ * @param arena  arena to allocate from
+ * @param size   size of the memory trying to be allocated (in bytes)
  *
- * @return a pointer to the new chunk (may be different from original), or
- *         NULL if an error ocurred
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
  */
-void* realloc ( void* memory, size_t size ) {
+void* arena_malloc ( void* arena, size_t size ) {
 
-    void*                new_memory;
-    struct inuse_header* header;
-    struct footer*       footer;
-    struct free_header*  next_header;
+    struct memory_context* saved = context;
+    void* memory;
 
-    if ( !memory )
-        return malloc( size );
+    context = arena;
+    memory  = malloc( size );
+    context = saved;
 
-    header = (struct inuse_header*)memory - 1;
-    footer = (struct footer*)( (char*)header + header->size ) - 1;
+    return memory;
+}
 
-    assert( header->status == INUSE_STATUS );
-    assert( header->size   == footer->size );
 
-    size += MIN_INUSE_CHUNK_SIZE;
+/**
+ * Returns a piece of memory allocated from a given arena
+ *
+ * @param arena   arena the memory came from
+ * @param memory  pointer to the memory to be freed
+ */
+void arena_free ( void* arena, void* memory ) {
 
-    /* if fits in current chunk */
+    struct memory_context* saved = context;
 
-    if ( size <= header->size ) {
+    context = arena;
 
-        size_t left_size = header->size - size;
+    free( memory );
 
-        if ( left_size < MIN_FREE_CHUNK_SIZE )
-            return memory;
+    context = saved;
+}
 
-        header->size = size;
 
-        header = (struct inuse_header*)( (char*)header + size );
+/**
+ * Discards every allocation of an arena at once, in O(bins) instead of
+ * one free per object: the bookkeeping is reinitialized and the arena's
+ * buffers are re-added untouched
+ *
+ * Configuration (external allocator, magazines, deferred coalescing)
+ * survives the reset; statistics don't
+ *
+ * @param arena  arena to reset
+ */
+void arena_reset ( void* arena ) {
 
-        header->status = INUSE_STATUS;
-        header->size   = left_size;
-        footer->size   = left_size;
+    struct memory_context* saved = context;
+    struct malloc_buffer buffers[ MAX_MALLOC_BUFFERS ];
+    struct free_header* bin;
+    size_t count, pos;
 
-        footer = (struct footer*)header - 1;
+    context = arena;
 
-        footer->size = size;
+    count = context->buffer_count;
 
-        free( header + 1 );
+    memcpy( buffers, context->buffers, count * sizeof( buffers[ 0 ] ) );
 
-        return memory;
-    }
+#ifdef MALLOC_SHARED
+    context->lock = 0;
+#endif
 
-    next_header = (struct free_header*)( footer + 1 );
+    context->free_memory     = 0;
+    context->last_chunk_size = 0;
+    context->buffer_count    = 0;
+    context->incoming        = NULL;
+    context->incoming_bytes  = 0;
 
-    /* if fits in current and (free) next chunk */
+#ifdef MALLOC_THREADS
+    context->remote_free = NULL;
+#endif
 
-    if ( next_header->status == FREE_STATUS &&
-         next_header->size + (size_t)header->size < size )
-    {
-        footer = (struct footer*)( (char*)footer + next_header->size );
+    context->span_count = 0;
 
-        footer->size = header->size += next_header->size;
+    for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ ) {
 
-        next_header->next->prev = next_header->prev;
-        next_header->prev->next = next_header->next;
+        context->magazines[ pos ].count  = 0;
+        context->fastbins[ pos ]         = NULL;
+        context->fastbin_counts[ pos ]   = 0;
+    }
 
-        next_header->next = NULL;
-        next_header->prev = NULL;
+    for ( pos = 0; TREE_BIN_MIN + pos < BIN_NUMBER; pos++ )
 
-        context->free_memory    -= next_header->size;
-        context->last_chunk_size = 0;
+        context->tree_roots[ pos ] = NULL;
 
-        return memory;
+    for ( pos = 0; pos < BIN_MAP_WORDS; pos++ )
+
+        context->bin_map[ pos ] = 0;
+
+    for ( bin = context->bins; bin < context->bins + BIN_NUMBER; bin++ ) {
+
+        bin->next = REF( bin );
+        bin->prev = REF( bin );
     }
 
-    /* else use an entirely new chunk */
+    memset( &context->stats, 0, sizeof( context->stats ) );
 
-    size -= MIN_INUSE_CHUNK_SIZE;
+    for ( pos = 0; pos < count; pos++ )
 
-    new_memory = malloc( size );
+        add_malloc_buffer( PTR( buffers[ pos ].base ),
+                           buffers[ pos ].size );
 
-    if ( new_memory ) {
+    context = saved;
+}
 
-        memcpy( new_memory, memory, size );
-        free( memory );
-    }
 
-    return new_memory;
+/**
+ * Set an external allocator. When malloc runs out of memory, the provided
+ * allocation function will be called
+ *
+ * This function should receive a first parameter with the minimum size of
+ * memory to be allocated, and a second parameter where the actual size of
+ * the memory allocated will be saved
+ * It should return a pointer to the allocated memory, or NULL if an error
+ * ocurred
+ *
+ * If the provided allocator is NULL, no external allocator will be used
+ *
+ * @param allocator  allocation function
+ */
+void set_external_alloc ( void* ( *allocator )( size_t , size_t* ) ) {
+
+    context->external_alloc = allocator;
 }
 
 
 /**
- * Checks the integrity of the memory context
+ * Set an external release function, undoing the external allocator's
+ * allocations. Needed for the direct large-allocation path
  *
- * Useful to detect buffer overflows and other memory corruptions
+ * If the provided function is NULL, no external releaser will be used
  *
- * @return NULL if no error was found, or a pointer to the block where the
- *         first memory corruption was detected
+ * @param release  release function (memory, size)
  */
-void* check_malloc ( void ) {
+void set_external_free ( void ( *release )( void*, size_t ) ) {
 
-    struct free_header *bin, *block, *last;
-    struct footer *footer;
-    size_t free_memory = context->free_memory;
+    context->external_free = release;
+}
 
-    for ( bin = context->bins; bin < context->bins + BIN_NUMBER; bin++ ) {
 
-        if ( bin->status != FREE_STATUS ) {
+/**
+ * Sets the size from which allocations bypass the bins and go straight
+ * to the external allocator, wholesale. Requires both set_external_alloc
+ * and set_external_free; 0 (the default) disables the direct path
+ *
+ * Direct allocations are invisible to the bins and to fragmentation, and
+ * their free is O(1); chunks already allocated keep working if the
+ * threshold changes
+ *
+ * @param threshold  minimum size for direct allocations (in bytes)
+ */
+void set_malloc_direct_threshold ( size_t threshold ) {
 
-            /* printf( "Error in context, bin %d\n", bin - context->bins ); */
-            return bin;
-        }
+    context->direct_threshold = threshold;
+}
 
-        if ( bin->size != sizeof( struct free_header ) ) {
 
-            /* printf( "Error in context, bin %d\n", bin - context->bins ); */
-            return bin;
-        }
+/**
+ * Selects the chunk placement policy of the current context
+ *
+ * MALLOC_POLICY_LOCALITY (the default) is the historical behaviour:
+ * size-sorted first fit with the LRU tie break plus the last-split
+ * reuse heuristic for small requests. MALLOC_POLICY_BEST_FIT is the
+ * same selection without the locality override - the size-sorted bins
+ * make the first fit the best (and exact, when one exists) fit already.
+ * MALLOC_POLICY_ADDRESS prefers the lowest-addressed fitting chunk
+ * within a bounded window, compacting towards low addresses (trie bins
+ * keep best-fit). A/B them against replay traces using the
+ * fragmentation numbers in malloc_stats
+ *
+ * @param policy  one of the MALLOC_POLICY_* constants
+ */
+void set_malloc_policy ( int policy ) {
 
-        last = bin;
+    assert( policy >= MALLOC_POLICY_LOCALITY &&
+            policy <= MALLOC_POLICY_ADDRESS );
 
-        for ( block = bin->next; block != bin; block = block->next ) {
+    context->policy = policy;
+}
 
-            if ( block->status != FREE_STATUS ) {
 
-                /* printf( "Error in block header\n" ); */
-                return block;
-            }
+/**
+ * Tells the allocator the page size backing the current context's
+ * buffers (e.g. 4096, or 2 MB huge pages). Allocations of a page or
+ * more are then carved at page-aligned offsets, so they never straddle
+ * an extra page; 0 (the default) disables the preference
+ *
+ * @param page_size  backing page size (a power of two), or 0
+ */
+void set_malloc_page_size ( size_t page_size ) {
 
-            if ( block->prev != last ) {
+    assert( !( page_size & ( page_size - 1 ) ) );
+    assert( !page_size || page_size > 16 );
 
-                /* printf( "Error in block header\n" ); */
-                return block;
-            }
+    /* alignments up to 16 are free anyway, and routing them through the
+       aligned path would just bounce back to the regular one */
 
-            footer = (struct footer*)( (char*)block + block->size ) - 1;
+    context->page_size = page_size > 16 ? page_size : 0;
+}
 
-            if ( block->size != footer->size ) {
 
-                /* printf( "Error in block footer\n" ); */
-                return footer;
-            }
+/**
+ * Turns deferred coalescing of the current context on or off
+ *
+ * While on, free just pushes chunks onto a fast unsorted incoming list;
+ * merging with neighbours and sorted bin insertion happen in batches,
+ * when an allocation can't be satisfied from the bins or when the
+ * deferred pool outgrows the binned free memory. Turning it off flushes
+ * the pending chunks
+ *
+ * @param enabled  non-zero to enable, 0 to disable
+ */
+void set_deferred_coalescing ( int enabled ) {
 
-            last = block;
-            free_memory -= block->size;
-        }
-    }
+    if ( !enabled && context->incoming )
 
-    if ( free_memory ) {
+        flush_incoming();
 
-        /* printf( "Error in context, free memory amount inconcistency\n" ); */
-        return context;
-    }
+    context->deferred_on = enabled;
+}
 
-    return NULL;
+
+#ifdef MALLOC_TRACE
+
+/**
+ * Installs (or, with NULL, removes) the tracing ring buffer of the
+ * current context. The caller owns the ring and its records array, whose
+ * capacity must be a power of two; set sample to N to keep 1 of every N
+ * events
+ *
+ * @param ring  tracing ring buffer
+ */
+void set_malloc_tracer ( struct malloc_trace_ring* ring ) {
+
+    context->tracer = ring;
 }
 
+#endif
+
 
 /**
- * Get a pointer with all malloc data, including all data-structures containing
- * the free chunks of memory
+ * Turns the small-page spans of the current context on or off
  *
- * Usefull when several separate malloc contexts are needed
+ * While on, objects up to 128 bytes are packed into page-sized spans
+ * whose metadata (size class and occupancy bitmap) lives at the start
+ * of the page: the objects themselves carry no header or footer, saving
+ * 16 bytes each and keeping allocator metadata off the caller's cache
+ * lines. Turning the mode off stops new spans; existing ones drain as
+ * their objects are freed
  *
- * @return pointer to current context
+ * @param enabled  non-zero to enable, 0 to disable
  */
-void* get_malloc_context ( void ) {
+void set_malloc_small_pages ( int enabled ) {
 
-    return context;
+    context->spans_on = enabled;
 }
 
 
 /**
- * Set the current context to a previously gotten context
+ * Turns the exact-fit fastbins of the current context on or off
  *
- * @param context pointer to a context
+ * While on, the last few freed chunks of each small size class are kept
+ * in a LIFO stack and handed straight back to allocations of the same
+ * size: the chunk is reused as-is (no status, footer or bin work), so
+ * free-then-alloc of a hot size returns the same cache-warm lines.
+ * Turning them off flushes every cached chunk back to the bins
+ *
+ * @param enabled  non-zero to enable, 0 to disable
  */
-void set_malloc_context ( void* new_context ) {
+void set_malloc_fastbins ( int enabled ) {
 
-    context = new_context;
+    size_t pos;
+
+    if ( !enabled )
+
+        for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ )
+
+            flush_fastbin( pos, 0 );
+
+    context->fastbins_on = enabled;
 }
 
 
 /**
- * Set an external allocator. When malloc runs out of memory, the provided
- * allocation function will be called
- *
- * This function should receive a first parameter with the minimum size of
- * memory to be allocated, and a second parameter where the actual size of
- * the memory allocated will be saved
- * It should return a pointer to the allocated memory, or NULL if an error
- * ocurred
+ * Turns the small-object magazines of the current context on or off
  *
- * If the provided allocator is NULL, no external allocator will be used
+ * While on, chunks up to MAX_SMALL_REQUEST bytes are alloc'ed and freed
+ * through per-size-class LIFO stacks, skipping the bins and coalescing.
+ * Turning them off flushes every cached chunk back to the bins
  *
- * @param allocator  allocation function
+ * @param enabled  non-zero to enable, 0 to disable
  */
-void set_external_alloc ( void* ( *allocator )( size_t , size_t* ) ) {
+void set_malloc_magazines ( int enabled ) {
 
-    context->external_alloc = allocator;
+    size_t pos;
+
+    if ( !enabled )
+
+        for ( pos = 0; pos < MAGAZINE_NUMBER; pos++ )
+
+            flush_magazine( context->magazines + pos,
+                            context->magazines[ pos ].count );
+
+    context->magazines_on = enabled;
 }
 
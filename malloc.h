@@ -19,15 +19,28 @@
 #include <stddef.h>
 
 
+/**
+ * If built with MALLOC_SHARED, every internal link is stored relative to
+ * the context base and a lock in the context arbitrates operations, so a
+ * heap living in a shared segment can be used by several processes even
+ * when they map it at different addresses: one calls init_malloc on the
+ * mapping, the rest just set_malloc_context to their own mapping of it.
+ * Function-pointer configuration (external allocator, tracer) must be
+ * identical in every process or left unset; not combinable with
+ * MALLOC_THREADS
+ */
+
+
 /**
  * Creates a new malloc context in the given memory buffer. Uses the remaining
  * memory for allocations
  *
  * Must be called before any malloc or free (unless a memory context has been
- * set manually)
+ * set manually). If MALLOC_THREADS is on, it must be called once per thread,
+ * each with its own buffer
  *
- * Size must be, at least, 180*sizeof( void* ) + 91*sizeof( size_t ), to let a
- * memory context fit
+ * Size must be, at least, sizeof( struct memory_context ) (a few KBs), to
+ * let a memory context fit
  *
  * @param memory  memory buffer
  * @param size    memory buffer size (in bytes)
@@ -48,9 +61,52 @@ void init_malloc ( void* memory, size_t size );
 void* malloc ( size_t size );
 
 
+/**
+ * Allocs a chunk of memory of a specified size, whose address is a
+ * multiple of a specified alignment
+ *
+ * Costs at most a few dozen bytes more than a plain malloc, independently
+ * of the alignment
+ *
+ * @param alignment  required alignment (a power of two)
+ * @param size       size of the memory trying to be allocated (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+void* memalign ( size_t alignment, size_t size );
+
+
+/**
+ * Allocs a batch of equally sized chunks of memory, amortizing the
+ * per-call work (bin search, list relinking) over the whole batch
+ *
+ * @param size    size of each chunk (in bytes)
+ * @param chunks  output array of @a count pointers
+ * @param count   number of chunks to allocate
+ *
+ * @return the number of chunks actually allocated (< count if memory ran
+ *         out); the first entries of @a chunks are valid
+ */
+size_t malloc_batch ( size_t size, void** chunks, size_t count );
+
+
+/**
+ * Returns a batch of allocated chunks of memory, coalescing neighbours
+ * in a single address-ordered pass
+ *
+ * Note that the array is sorted in place during the call
+ *
+ * @param chunks  array of pointers to free (NULL entries are fine)
+ * @param count   number of pointers in the array
+ */
+void free_batch ( void** chunks, size_t count );
+
+
 /**
  * Allocates a chunk of memory large enough for @a count objects that are
- * @a size bytes each. The allocated memory is filled with 0s
+ * @a size bytes each. The allocated memory is filled with 0s (skipping
+ * the clearing of memory known to still be OS-zeroed, see
+ * add_malloc_buffer_zeroed), and a count * size overflow returns NULL
  *
  * @param count  number of objects
  * @param size   size of each object (in bytes)
@@ -63,6 +119,9 @@ void* calloc ( size_t count, size_t size );
 /**
  * Resizes a previouly malloc'ed chunk of memory to a given new size
  *
+ * Grows in place whenever a free neighbour allows it, so most growing
+ * reallocations avoid the full malloc+memcpy+free round trip
+ *
  * @param memory  pointer to the memory to be resized
  * @param size    new desired size
  *
@@ -72,14 +131,255 @@ void* calloc ( size_t count, size_t size );
 void* realloc ( void* memory, size_t size );
 
 
+/**
+ * Resizes a previouly malloc'ed chunk of memory to a given new size, only
+ * if this can be done without moving it, so pointer-stable structures can
+ * try growing without risking a relocation
+ *
+ * @param memory  pointer to the memory to be resized
+ * @param size    new desired size
+ *
+ * @return @a memory on success, or NULL if the chunk would have to move
+ *         (the original memory is untouched)
+ */
+void* realloc_in_place ( void* memory, size_t size );
+
+
 /**
  * Returns a piece of allocated memory
  *
+ * If MALLOC_THREADS is on and the memory belongs to another thread's
+ * context, it is handed over to that context (lock-free) and freed there
+ * on its next malloc
+ *
  * @param memory  pointer to the memory to be freed
  */
 void free ( void* memory );
 
 
+/**
+ * Compile-time layout constants, mirroring the internal chunk format
+ * (checked against it by assertions in the implementation): per-chunk
+ * overhead, minimum chunk size, and the request-to-chunk-size padding
+ * rule. They exist so malloc_sized can fold a constant request size down
+ * to its bin index at compile time
+ */
+#ifdef MALLOC_BIG_HEAP
+#define MALLOC_CHUNK_WORD 8
+#else
+#define MALLOC_CHUNK_WORD 4
+#endif
+
+#ifdef MALLOC_HARDEN
+#define MALLOC_WORDS_HARDEN 1
+#else
+#define MALLOC_WORDS_HARDEN 0
+#endif
+
+#ifdef MALLOC_PROFILE
+#define MALLOC_WORDS_PROFILE 2
+#else
+#define MALLOC_WORDS_PROFILE 0
+#endif
+
+#define MALLOC_HEADER_SIZE                                                 \
+    ( MALLOC_CHUNK_WORD * ( 1 + MALLOC_WORDS_HARDEN + MALLOC_WORDS_PROFILE ) )
+
+#define MALLOC_FOOTER_SIZE                                                 \
+    ( MALLOC_CHUNK_WORD * ( 1 + MALLOC_WORDS_HARDEN ) )
+
+#define MALLOC_CHUNK_OVERHEAD ( MALLOC_HEADER_SIZE + MALLOC_FOOTER_SIZE )
+
+#define MALLOC_MIN_CHUNK                                                   \
+    ( ( MALLOC_HEADER_SIZE + sizeof( void* ) - 1 )                         \
+          / sizeof( void* ) * sizeof( void* )                              \
+      + 2 * sizeof( void* ) + MALLOC_FOOTER_SIZE )
+
+#define MALLOC_PAD_SIZE( size )                                            \
+    ( ( ( (size) + MALLOC_CHUNK_OVERHEAD < MALLOC_MIN_CHUNK                \
+              ? MALLOC_MIN_CHUNK                                           \
+              : (size) + MALLOC_CHUNK_OVERHEAD ) + 15 ) & ~(size_t)15 )
+
+
+/**
+ * Allocs a chunk of memory of a specified size, resolving the size's bin
+ * at compile time when @a size is a constant expression: the common
+ * exact-fit case then skips the size-to-bin computation and the search
+ * loops entirely (check bin non-empty, unlink head, done)
+ *
+ * Equivalent to malloc( size ) in every other way
+ */
+#ifdef __GNUC__
+
+#define MALLOC_SIZE_LOG2( size )                                           \
+    ( 63 - __builtin_clzll( (unsigned long long)(size) ) )
+
+#define MALLOC_BIN_INDEX( size )                                           \
+    ( (size) <= 512 ? ( (size_t)(size) >> 3 ) - 1                          \
+      : (size) <  576 ? (size_t)63 : (size) < 640  ? (size_t)64            \
+      : (size) <  768 ? (size_t)65 : (size) < 1024 ? (size_t)66            \
+      : (size_t)( 67 + MALLOC_SIZE_LOG2( size ) - 10 ) )
+
+#ifdef MALLOC_MAX_HEAP_SIZE
+#define MALLOC_BIN_CLAMP( pos )                                            \
+    ( (pos) < MALLOC_BIN_NUMBER ? (pos) : MALLOC_BIN_NUMBER - 1 )
+#else
+#define MALLOC_BIN_CLAMP( pos ) ( pos )
+#endif
+
+#define malloc_sized( size )                                               \
+    malloc_from_bin( MALLOC_BIN_CLAMP(                                     \
+                         (size_t)MALLOC_BIN_INDEX(                         \
+                             MALLOC_PAD_SIZE( size ) ) ),                  \
+                     MALLOC_PAD_SIZE( size ) )
+
+#else
+
+#define malloc_sized( size ) malloc( size )
+
+#endif
+
+
+/**
+ * Backs the malloc_sized macro: takes the head chunk of the given bin
+ * when it's an exact fit, falling back to a plain malloc otherwise
+ *
+ * @param bin_pos  bin index of the padded chunk size
+ * @param size     padded chunk size (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+void* malloc_from_bin ( size_t bin_pos, size_t size );
+
+
+#ifdef MALLOC_PROFILE
+
+/**
+ * Allocs a chunk of memory of a specified size, tagging it with a
+ * caller-provided allocation-site id (only when built with
+ * MALLOC_PROFILE, which also timestamps every allocation)
+ *
+ * @param size  size of the memory trying to be allocated (in bytes)
+ * @param tag   allocation-site id (0 is what plain malloc uses)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+void* malloc_tagged ( size_t size, size_t tag );
+
+
+/**
+ * Walks the boundary tags of every registered buffer and reports each
+ * live chunk - tag, chunk size, age in allocations - to the callback, so
+ * a slow leak can be pinned to its allocation site without stopping the
+ * process. The callback must not allocate
+ *
+ * @param callback  called as callback( tag, size, age, memory ) per
+ *                  live chunk
+ */
+void malloc_census ( void ( *callback )( size_t tag, size_t size,
+                                         size_t age, void* memory ) );
+
+#endif /* MALLOC_PROFILE */
+
+
+/**
+ * Number of allocation bins; sizes the per-bin counters of struct
+ * malloc_stats. Grows when MALLOC_BIG_HEAP widens the size range, and
+ * shrinks when MALLOC_MAX_HEAP_SIZE caps it: defining the latter to the
+ * biggest buffer a target will ever register (e.g. 0x80000 for a 512 KB
+ * firmware pool) drops the unreachable bins from the context's bin
+ * array, bitmap and trie roots - recovering a couple of KB of a small
+ * heap - and narrows the size-class search range accordingly
+ */
+#if defined MALLOC_MAX_HEAP_SIZE
+
+#define MALLOC_BIN_NUMBER                                                  \
+    ( MALLOC_MAX_HEAP_SIZE < 520                                           \
+          ? (size_t)MALLOC_MAX_HEAP_SIZE / 8                               \
+          : (size_t)( 64                                                   \
+              + ( MALLOC_MAX_HEAP_SIZE >= 576 )                            \
+              + ( MALLOC_MAX_HEAP_SIZE >= 640 )                            \
+              + ( MALLOC_MAX_HEAP_SIZE >= 768 )                            \
+              + ( MALLOC_MAX_HEAP_SIZE >= 1024 )                           \
+              + ( MALLOC_MAX_HEAP_SIZE >= 2048 )                           \
+              + ( MALLOC_MAX_HEAP_SIZE >= 4096 )                           \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x2000 )                         \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x4000 )                         \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x8000 )                         \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x10000 )                        \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x20000 )                        \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x40000 )                        \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x80000 )                        \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x100000 )                       \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x200000 )                       \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x400000 )                       \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x800000 )                       \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x1000000 )                      \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x2000000 )                      \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x4000000 )                      \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x8000000 )                      \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x10000000 )                     \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x20000000 )                     \
+              + ( MALLOC_MAX_HEAP_SIZE >= 0x40000000 )                     \
+              + ( (unsigned long long)MALLOC_MAX_HEAP_SIZE                 \
+                      >= 0x80000000ull ) ) )
+
+#elif defined MALLOC_BIG_HEAP
+#define MALLOC_BIN_NUMBER 120
+#else
+#define MALLOC_BIN_NUMBER 89
+#endif
+
+
+/**
+ * Allocation statistics of a memory context
+ *
+ * The counters reflect the caller's view: chunks cached by the magazines
+ * or the deferred-coalescing list count as freed, even though they are
+ * not yet back in free_memory
+ */
+struct malloc_stats {
+
+    size_t free_memory;          /* bytes ready for allocation           */
+    size_t inuse_memory;         /* bytes currently held by the caller   */
+    size_t peak_inuse_memory;    /* high-water mark of inuse_memory      */
+    size_t total_memory;         /* bytes in all registered buffers      */
+    size_t reclaimable_memory;   /* bytes in buffers malloc_trim could
+                                    give back right now                  */
+
+    size_t free_chunk_count;     /* chunks in the bins                   */
+    size_t largest_free_chunk;   /* size of the biggest free chunk       */
+
+    size_t alloc_count;          /* successful mallocs (and the like)    */
+    size_t free_count;           /* frees of non-NULL memory             */
+    size_t realloc_count;        /* realloc calls                        */
+    size_t split_count;          /* chunks split by allocations          */
+    size_t coalesce_count;       /* neighbour merges done by free        */
+    size_t external_alloc_count; /* calls into the external allocator    */
+    size_t invalid_free_count;   /* wild/double frees caught and ignored */
+
+    size_t bin_allocs[ MALLOC_BIN_NUMBER ]; /* allocations per size bin  */
+    size_t bin_frees[ MALLOC_BIN_NUMBER ];  /* frees per size bin        */
+
+    size_t bin_free_chunks[ MALLOC_BIN_NUMBER ]; /* current free chunks
+                                    per bin: the occupancy histogram.
+                                    largest_free_chunk / free_memory is
+                                    the external fragmentation ratio    */
+};
+
+
+/**
+ * Fills a snapshot of the current context's allocation statistics
+ *
+ * All counters are maintained on the allocation hot paths, so this is
+ * O(1) (plus a bitmap scan for the largest free chunk) and safe to call
+ * in production, unlike the O(heap) check_malloc walk
+ *
+ * @param stats  output statistics
+ */
+void malloc_stats ( struct malloc_stats* stats );
+
+
 /**
  * Checks the integrity of the memory context
  *
@@ -91,10 +391,135 @@ void free ( void* memory );
 void* check_malloc ( void );
 
 
+/**
+ * Adds a new memory area for allocations, recording the NUMA node it
+ * lives on, so malloc_on_node can restrict placement to it
+ *
+ * @param memory   memory buffer
+ * @param size     memory buffer size (in bytes)
+ * @param node_id  NUMA node of the memory
+ */
+void add_malloc_buffer_node ( void* memory, size_t size, int node_id );
+
+
+/**
+ * Allocs a chunk of memory of a specified size, restricted to buffers
+ * registered (via add_malloc_buffer_node) on a given NUMA node. There is
+ * no fallback: if the node's buffers can't serve the request the call
+ * fails, and the caller decides whether a plain malloc is acceptable
+ *
+ * @param size     size of the memory trying to be allocated (in bytes)
+ * @param node_id  NUMA node the memory must live on
+ *
+ * @return a pointer to the allocated memory, or NULL if no chunk on the
+ *         node is big enough
+ */
+void* malloc_on_node ( size_t size, int node_id );
+
+
+/**
+ * Adds a new memory area for allocations, promising that it is zero
+ * filled (e.g. fresh pages straight from the OS). calloc then avoids
+ * re-clearing memory carved from the area's never-touched tail, which
+ * turns start-up calloc of huge tables into plain allocations
+ *
+ * @param memory  memory buffer (must be all zeros)
+ * @param size    memory buffer size (in bytes)
+ */
+void add_malloc_buffer_zeroed ( void* memory, size_t size );
+
+
+/**
+ * Guarantees that a following burst of allocations totalling up to
+ * @a bytes (including per-chunk overhead) will succeed, by making sure a
+ * single free chunk that big exists: caches are flushed and coalesced
+ * and, failing that, the external allocator is asked to grow the context
+ *
+ * @param bytes  size of the burst to guarantee (in bytes)
+ *
+ * @return 1 if the reservation holds, 0 if the memory isn't there
+ */
+int malloc_reserve ( size_t bytes );
+
+
+/**
+ * Sets a handler invoked whenever free detects an invalid pointer: a
+ * wild free, a double free, or a stale pointer whose chunk tags no
+ * longer cohere. Such frees are counted (see malloc_stats) and ignored
+ * rather than corrupting the heap; the handler is for logging or
+ * crashing on your own terms
+ *
+ * Always on - unlike running check_malloc per operation, this costs a
+ * handful of compares per free
+ *
+ * @param handler  function receiving the offending pointer, or NULL
+ */
+void set_malloc_error_handler ( void ( *handler )( void* ) );
+
+
+/**
+ * Sets a callback invoked (from inside the allocation that crosses the
+ * line) whenever free memory drops below a threshold, so caches can
+ * shed load before allocations start failing - failing a packet
+ * allocation mid-pipeline costs a retransmit; shedding cache early
+ * costs almost nothing. The callback may free memory, but must not
+ * allocate (nor touch the allocator at all in MALLOC_SHARED builds)
+ *
+ * @param threshold  free-memory low-water mark (in bytes)
+ * @param callback   function receiving the current free memory, or NULL
+ *                   to disable
+ */
+void set_low_memory_callback ( size_t threshold,
+                               void ( *callback )( size_t ) );
+
+
+/**
+ * Releases every registered buffer that no longer holds any live chunk
+ * back through the external release function (set_external_free), so
+ * memory committed for a traffic spike doesn't stay committed forever.
+ * Flushes the magazines and the deferred list first
+ *
+ * @return the number of bytes given back
+ */
+size_t malloc_trim ( void );
+
+
+/**
+ * Resumable cursor for check_malloc_step. Start (and restart) with all
+ * fields zeroed
+ */
+struct malloc_check_cursor {
+
+    size_t buffer;
+    size_t offset;
+    size_t stamp;
+};
+
+
+/**
+ * Validates a slice of the heap, at most @a budget chunks, resuming from
+ * (and updating) the given cursor, so a full audit can be amortized over
+ * idle moments instead of stalling for the O(heap) check_malloc
+ *
+ * Unlike check_malloc, this walks the boundary tags of every registered
+ * buffer front to back, so inuse chunks are validated too. One pass over
+ * all buffers ends with a NULL return and the cursor rewound; if the
+ * heap changed under a parked cursor, that buffer is simply rescanned
+ * from its start
+ *
+ * @param cursor  walk position, updated in place
+ * @param budget  max number of chunks to validate in this call
+ *
+ * @return NULL if no error was found, or a pointer to the place where
+ *         the first memory corruption was detected
+ */
+void* check_malloc_step ( struct malloc_check_cursor* cursor, size_t budget );
+
+
 /**
  * Adds a new memory area for allocations to the current memory context
  *
- * The buffer should be < 2 GB
+ * The buffer should be < 2 GB (< 4 EB if MALLOC_BIG_HEAP is on)
  *
  * @param memory  memory buffer
  * @param size    memory buffer sillegaste a tu casa? ze (in bytes)
@@ -113,6 +538,30 @@ void add_malloc_buffer ( void* memory, size_t size );
 void* get_malloc_context ( void );
 
 
+/**
+ * Quiesces the current context and converts every internal pointer to an
+ * offset from the context base, so a heap living in one mapping (context
+ * and buffers moving together) can be persisted to a file or shared
+ * segment. Flushes all caches first, clears the external allocator /
+ * releaser / tracer (function pointers don't survive relocation), and
+ * leaves the current context NULL. Live direct allocations can't be
+ * frozen
+ */
+void malloc_freeze ( void );
+
+
+/**
+ * Rebinds a frozen heap mapped at (a possibly different) @a base: every
+ * offset is turned back into a pointer and the context becomes current.
+ * Re-set the external allocator and friends afterwards if wanted
+ *
+ * @param base  address the frozen context is mapped at
+ *
+ * @return the thawed context (also installed as current)
+ */
+void* malloc_thaw ( void* base );
+
+
 /**
  * Set the current context to a previously gotten context
  *
@@ -121,6 +570,52 @@ void* get_malloc_context ( void );
 void set_malloc_context ( void* new_context );
 
 
+/**
+ * Creates a new arena (an independent memory context) in the given memory
+ * buffer, without disturbing the current context
+ *
+ * Arenas are handy for request-scoped allocations: alloc thousands of
+ * short-lived objects from one, then throw them all away with a single
+ * arena_reset instead of freeing them one by one
+ *
+ * @param memory  memory buffer
+ * @param size    memory buffer size (in bytes)
+ *
+ * @return the arena, or NULL if the buffer can't fit one
+ */
+void* malloc_arena_create ( void* memory, size_t size );
+
+
+/**
+ * Allocs a chunk of memory of a specified size from a given arena
+ *
+ * @param arena  arena to allocate from
+ * @param size   size of the memory trying to be allocated (in bytes)
+ *
+ * @return a pointer to the allocated memory, or NULL if an error ocurred
+ */
+void* arena_malloc ( void* arena, size_t size );
+
+
+/**
+ * Returns a piece of memory allocated from a given arena
+ *
+ * @param arena   arena the memory came from
+ * @param memory  pointer to the memory to be freed
+ */
+void arena_free ( void* arena, void* memory );
+
+
+/**
+ * Discards every allocation of an arena at once, in O(bins) instead of
+ * one free per object. Configuration (external allocator, magazines,
+ * deferred coalescing) survives the reset; statistics don't
+ *
+ * @param arena  arena to reset
+ */
+void arena_reset ( void* arena );
+
+
 /**
  * Set an external allocator. When malloc runs out of memory, the provided
  * allocation function will be called
@@ -138,5 +633,182 @@ void set_malloc_context ( void* new_context );
 void set_external_alloc ( void* ( *allocator )( size_t , size_t* ) );
 
 
+/**
+ * Set an external release function, undoing the external allocator's
+ * allocations. Needed for the direct large-allocation path
+ *
+ * If the provided function is NULL, no external releaser will be used
+ *
+ * @param release  release function (memory, size)
+ */
+void set_external_free ( void ( *release )( void*, size_t ) );
+
+
+/**
+ * Sets the size from which allocations bypass the bins and go straight
+ * to the external allocator (with free returning the memory wholesale
+ * through the external release function, in O(1)), keeping long-lived
+ * multi-megabyte buffers out of the chunk heap. Requires both
+ * set_external_alloc and set_external_free
+ *
+ * 0 (the default) disables the direct path
+ *
+ * @param threshold  minimum size for direct allocations (in bytes)
+ */
+void set_malloc_direct_threshold ( size_t threshold );
+
+
+/**
+ * Chunk placement policies
+ *
+ * @see set_malloc_policy
+ */
+#define MALLOC_POLICY_LOCALITY 0
+#define MALLOC_POLICY_BEST_FIT 1
+#define MALLOC_POLICY_ADDRESS  2
+
+
+/**
+ * Selects the chunk placement policy of the current context
+ *
+ * MALLOC_POLICY_LOCALITY (the default) is the historical behaviour:
+ * size-sorted first fit with the LRU tie break plus the last-split
+ * reuse heuristic for small requests. MALLOC_POLICY_BEST_FIT is the
+ * same selection without the locality override - the size-sorted bins
+ * make the first fit the best (and exact, when one exists) fit already,
+ * which also covers exact-fit-first. MALLOC_POLICY_ADDRESS prefers the
+ * lowest-addressed fitting chunk within a bounded window, compacting
+ * towards low addresses. A/B policies against replay traces using the
+ * fragmentation numbers in malloc_stats (largest_free_chunk over
+ * free_memory, and the bin_free_chunks occupancy histogram)
+ *
+ * @param policy  one of the MALLOC_POLICY_* constants
+ */
+void set_malloc_policy ( int policy );
+
+
+/**
+ * Tells the allocator the page size backing the current context's
+ * buffers (e.g. 4096, or 2 MB huge pages). Allocations of a page or
+ * more are then carved at page-aligned offsets, so they never straddle
+ * an extra page; 0 (the default) disables the preference
+ *
+ * All payloads are 16-byte aligned regardless of this setting, and page
+ * sizes of 16 or less are treated as 0
+ *
+ * @param page_size  backing page size (a power of two), or 0
+ */
+void set_malloc_page_size ( size_t page_size );
+
+
+/**
+ * Turns deferred coalescing of the current context on or off
+ *
+ * While on, free just pushes chunks onto a fast unsorted incoming list;
+ * merging with neighbours and sorted bin insertion happen in batches,
+ * when an allocation can't be satisfied from the bins or when the
+ * deferred pool outgrows the binned free memory. Turning it off flushes
+ * the pending chunks
+ *
+ * Off by default
+ *
+ * @param enabled  non-zero to enable, 0 to disable
+ */
+void set_deferred_coalescing ( int enabled );
+
+
+#ifdef MALLOC_TRACE
+
+/**
+ * Allocation event tracing (only when built with MALLOC_TRACE; the
+ * default build carries no tracing code at all)
+ *
+ * Events are appended to a caller-provided ring as fixed-size binary
+ * records: operation, size, address and a cycle timestamp. The producer
+ * side is lock-free (one producer per context, release-published head);
+ * a consumer chases head with its own tail, modulo capacity
+ */
+#define MALLOC_TRACE_ALLOC   'a'
+#define MALLOC_TRACE_FREE    'f'
+#define MALLOC_TRACE_REALLOC 'r'
+#define MALLOC_TRACE_GROW    'x'
+
+struct malloc_trace_record {
+
+    unsigned long long timestamp; /* cycles (0 where rdtsc is missing) */
+    void*              address;
+    size_t             size;
+    unsigned int       op;
+};
+
+struct malloc_trace_ring {
+
+    struct malloc_trace_record* records;
+
+    size_t capacity; /* number of records; must be a power of two */
+    size_t head;     /* total records ever written (wraps the array) */
+    size_t sample;   /* keep 1 of every sample events (0/1 = all)    */
+    size_t skipped;  /* producer scratch for the sampling counter    */
+};
+
+
+/**
+ * Installs (or, with NULL, removes) the tracing ring buffer of the
+ * current context. The caller owns the ring and its records array
+ *
+ * @param ring  tracing ring buffer
+ */
+void set_malloc_tracer ( struct malloc_trace_ring* ring );
+
+#endif /* MALLOC_TRACE */
+
+
+/**
+ * Turns the small-page spans of the current context on or off
+ *
+ * While on, objects up to 128 bytes are packed into page-sized spans
+ * whose metadata lives out-of-band at the start of the page, so small
+ * objects carry no per-object header or footer at all (16 bytes saved
+ * per object, and allocator metadata stops sharing cache lines with
+ * object data). Turning the mode off stops new spans; existing ones
+ * drain as their objects are freed
+ *
+ * Off by default
+ *
+ * @param enabled  non-zero to enable, 0 to disable
+ */
+void set_malloc_small_pages ( int enabled );
+
+
+/**
+ * Turns the exact-fit fastbins of the current context on or off
+ *
+ * While on, the last few freed chunks of each small size class are kept
+ * in a LIFO stack and handed straight back to allocations of the same
+ * size, returning the same cache-warm lines with no bin, footer or
+ * status work at all. Turning them off flushes the cached chunks
+ *
+ * Off by default
+ *
+ * @param enabled  non-zero to enable, 0 to disable
+ */
+void set_malloc_fastbins ( int enabled );
+
+
+/**
+ * Turns the small-object magazines of the current context on or off
+ *
+ * While on, small chunks are alloc'ed and freed through per-size-class
+ * LIFO stacks, skipping the bins and coalescing (faster, but cached
+ * chunks aren't merged with their neighbours until the magazines are
+ * flushed). Turning them off flushes every cached chunk back to the bins
+ *
+ * Off by default
+ *
+ * @param enabled  non-zero to enable, 0 to disable
+ */
+void set_malloc_magazines ( int enabled );
+
+
 #endif /* _MALLOC_H_ */
 
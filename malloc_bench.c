@@ -0,0 +1,398 @@
+/**
+ * malloc_bench.c - C memory allocator
+ *
+ * Written in 2011 by Dario Sneidermanis (dariosn@gmail.com)
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+/**
+ * Benchmark harness: drives the allocator with synthetic workloads (or a
+ * recorded trace) and reports throughput, per-operation latency
+ * percentiles and fragmentation over time
+ *
+ * Usage:  malloc_bench <workload> [ops]
+ *
+ * Workloads:
+ *   churn     alloc/free of one hot size (fast-path latency)
+ *   mix       random alloc/free over a small/large size-class mix
+ *   producer  FIFO producer/consumer queue (alloc head, free tail)
+ *   ramp      fragmentation ramp: mass alloc, free every other, big allocs
+ *   replay    replay a trace from stdin; lines are
+ *                 a <id> <bytes>   malloc
+ *                 f <id>           free
+ *                 r <id> <bytes>   realloc
+ *
+ * Every run is deterministic (fixed-seed xorshift), so two builds can be
+ * compared op by op
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "malloc.h"
+
+
+#define MEM_SIZE    64              /* size of memory pool (in MB)       */
+#define MAX_OPS     2000000         /* latency samples we can hold       */
+#define MAX_LIVE    65536           /* max simultaneous live chunks      */
+#define FRAG_EVERY  8192            /* ops between fragmentation samples */
+
+
+static char memory_pool[ 1024 * 1024 * MEM_SIZE ];
+
+static void* live[ MAX_LIVE ];
+
+static unsigned long long alloc_ns[ MAX_OPS ];
+static unsigned long long free_ns[ MAX_OPS ];
+static size_t alloc_samples, free_samples;
+
+
+static unsigned long rng_state = 0x9e3779b9ul;
+
+static unsigned long rng ( void ) {
+
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+
+    return rng_state;
+}
+
+
+static unsigned long long now_ns ( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (unsigned long long)ts.tv_sec * 1000000000ull +
+           (unsigned long long)ts.tv_nsec;
+}
+
+
+static void* timed_malloc ( size_t size ) {
+
+    unsigned long long start = now_ns();
+    void* chunk = malloc( size );
+
+    if ( alloc_samples < MAX_OPS )
+        alloc_ns[ alloc_samples++ ] = now_ns() - start;
+
+    return chunk;
+}
+
+
+static void timed_free ( void* chunk ) {
+
+    unsigned long long start = now_ns();
+
+    free( chunk );
+
+    if ( free_samples < MAX_OPS )
+        free_ns[ free_samples++ ] = now_ns() - start;
+}
+
+
+static int compare_ns ( const void* a, const void* b ) {
+
+    unsigned long long na = *(const unsigned long long*)a;
+    unsigned long long nb = *(const unsigned long long*)b;
+
+    return na < nb ? -1 : na > nb;
+}
+
+
+static void report_latency ( const char* name, unsigned long long* ns,
+                             size_t count )
+{
+    if ( !count )
+        return;
+
+    qsort( ns, count, sizeof( *ns ), compare_ns );
+
+    printf( "%-7s p50 %6llu ns   p99 %6llu ns   p999 %6llu ns   "
+            "max %8llu ns  (%zu ops)\n",
+            name,
+            ns[ count / 2 ],
+            ns[ count - 1 - count / 100 ],
+            ns[ count - 1 - count / 1000 ],
+            ns[ count - 1 ],
+            count );
+}
+
+
+static void report_fragmentation ( size_t ops_done ) {
+
+    struct malloc_stats stats;
+
+    malloc_stats( &stats );
+
+    printf( "frag   %9zu ops   free %9zu B   largest %9zu B   "
+            "ratio %3zu%%   chunks %zu\n",
+            ops_done,
+            stats.free_memory,
+            stats.largest_free_chunk,
+            stats.free_memory
+                ? stats.largest_free_chunk * 100 / stats.free_memory : 100,
+            stats.free_chunk_count );
+}
+
+
+/**
+ * Picks a size from a mix resembling our production histograms: mostly
+ * small objects, a tail of buffers up to 256 KB
+ */
+static size_t mixed_size ( void ) {
+
+    unsigned long roll = rng() % 100;
+
+    if ( roll < 60 )
+        return 16 + rng() % 112;
+
+    if ( roll < 85 )
+        return 128 + rng() % 1920;
+
+    if ( roll < 97 )
+        return 2048 + rng() % 30720;
+
+    return 32768 + rng() % 229376;
+}
+
+
+static void run_churn ( size_t ops ) {
+
+    size_t pos;
+    void*  chunk;
+
+    for ( pos = 0; pos < ops; pos++ ) {
+
+        chunk = timed_malloc( 64 );
+
+        if ( chunk )
+            timed_free( chunk );
+
+        if ( pos % FRAG_EVERY == 0 )
+            report_fragmentation( pos );
+    }
+}
+
+
+static void run_mix ( size_t ops ) {
+
+    size_t pos, slot;
+
+    for ( pos = 0; pos < ops; pos++ ) {
+
+        slot = rng() % 4096;
+
+        if ( live[ slot ] ) {
+
+            timed_free( live[ slot ] );
+
+            live[ slot ] = NULL;
+
+        } else
+            live[ slot ] = timed_malloc( mixed_size() );
+
+        if ( pos % FRAG_EVERY == 0 )
+            report_fragmentation( pos );
+    }
+
+    for ( slot = 0; slot < 4096; slot++ )
+
+        if ( live[ slot ] ) {
+
+            timed_free( live[ slot ] );
+
+            live[ slot ] = NULL;
+        }
+}
+
+
+static void run_producer ( size_t ops ) {
+
+    size_t head = 0, tail = 0, depth = 1024, pos;
+
+    for ( pos = 0; pos < ops; pos++ ) {
+
+        live[ head % depth ] = timed_malloc( mixed_size() );
+
+        head++;
+
+        if ( head - tail == depth ) {
+
+            if ( live[ tail % depth ] )
+                timed_free( live[ tail % depth ] );
+
+            tail++;
+        }
+
+        if ( pos % FRAG_EVERY == 0 )
+            report_fragmentation( pos );
+    }
+
+    while ( tail < head ) {
+
+        if ( live[ tail % depth ] )
+            timed_free( live[ tail % depth ] );
+
+        tail++;
+    }
+}
+
+
+static void run_ramp ( size_t ops ) {
+
+    size_t round, slot, count;
+    void*  big;
+
+    for ( round = 0; round * MAX_LIVE * 2 < ops; round++ ) {
+
+        for ( count = 0; count < MAX_LIVE; count++ )
+
+            live[ count ] = timed_malloc( 16 + rng() % 240 );
+
+        /* free every other chunk: worst-case external fragmentation */
+
+        for ( slot = 0; slot < MAX_LIVE; slot += 2 )
+
+            if ( live[ slot ] ) {
+
+                timed_free( live[ slot ] );
+
+                live[ slot ] = NULL;
+            }
+
+        report_fragmentation( round * MAX_LIVE * 2 );
+
+        big = timed_malloc( 1024 * 1024 );
+
+        if ( big )
+            timed_free( big );
+
+        for ( slot = 1; slot < MAX_LIVE; slot += 2 )
+
+            if ( live[ slot ] ) {
+
+                timed_free( live[ slot ] );
+
+                live[ slot ] = NULL;
+            }
+    }
+}
+
+
+static void run_replay ( void ) {
+
+    char   op;
+    size_t id, bytes, line = 0;
+
+    while ( scanf( " %c %zu", &op, &id ) == 2 ) {
+
+        line++;
+
+        if ( id >= MAX_LIVE ) {
+
+            fprintf( stderr, "trace line %zu: id %zu too big\n", line, id );
+            continue;
+        }
+
+        switch ( op ) {
+
+            case 'a':
+
+                if ( scanf( "%zu", &bytes ) != 1 )
+                    return;
+
+                live[ id ] = timed_malloc( bytes );
+                break;
+
+            case 'f':
+
+                timed_free( live[ id ] );
+
+                live[ id ] = NULL;
+                break;
+
+            case 'r':
+
+                if ( scanf( "%zu", &bytes ) != 1 )
+                    return;
+
+                live[ id ] = realloc( live[ id ], bytes );
+                break;
+
+            default:
+
+                fprintf( stderr, "trace line %zu: bad op '%c'\n", line, op );
+                return;
+        }
+
+        if ( line % FRAG_EVERY == 0 )
+            report_fragmentation( line );
+    }
+
+    for ( id = 0; id < MAX_LIVE; id++ )
+
+        if ( live[ id ] ) {
+
+            timed_free( live[ id ] );
+
+            live[ id ] = NULL;
+        }
+}
+
+
+int main ( int argc, char** argv ) {
+
+    const char* workload = argc > 1 ? argv[ 1 ] : "mix";
+    size_t ops = argc > 2 ? (size_t)atol( argv[ 2 ] ) : 1000000;
+    unsigned long long start;
+    size_t done;
+
+    if ( ops > MAX_OPS )
+        ops = MAX_OPS;
+
+    init_malloc( memory_pool, sizeof( memory_pool ) );
+
+    start = now_ns();
+
+    if      ( !strcmp( workload, "churn" ) )    run_churn( ops );
+    else if ( !strcmp( workload, "mix" ) )      run_mix( ops );
+    else if ( !strcmp( workload, "producer" ) ) run_producer( ops );
+    else if ( !strcmp( workload, "ramp" ) )     run_ramp( ops );
+    else if ( !strcmp( workload, "replay" ) )   run_replay();
+    else {
+
+        fprintf( stderr, "unknown workload '%s'\n", workload );
+        return 1;
+    }
+
+    done = alloc_samples + free_samples;
+
+    printf( "\n%s: %zu ops in %llu ms  (%llu ops/sec)\n",
+            workload, done,
+            ( now_ns() - start ) / 1000000ull,
+            done * 1000000000ull / ( now_ns() - start + 1 ) );
+
+    report_latency( "malloc", alloc_ns, alloc_samples );
+    report_latency( "free", free_ns, free_samples );
+
+    if ( check_malloc() ) {
+
+        printf( "THERE WAS AN ERROR\n" );
+        return 1;
+    }
+
+    report_fragmentation( done );
+
+    return 0;
+}
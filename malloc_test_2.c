@@ -22,6 +22,28 @@
 
 char mem1[ SIZE ], mem2[ SIZE/2 ], *ptr1, *ptr2, *ptr3;
 
+char extra[ SIZE/4 ];
+size_t extra_used = 0;
+int  extra_calls = 0;
+
+
+/* minimal external allocator: hands out exactly the requested minimum */
+
+static void* external ( size_t min_size, size_t* actual_size ) {
+
+    void* memory = extra + extra_used;
+
+    extra_calls++;
+
+    if ( extra_used + min_size > sizeof( extra ) )
+        return NULL;
+
+    extra_used   += min_size;
+    *actual_size  = min_size;
+
+    return memory;
+}
+
 
 int main ( void ) {
 
@@ -61,6 +83,143 @@ int main ( void ) {
     free( ptr2 );
     assert( !check_malloc() );
 
+    assert( ptr1 = memalign( 4096, SIZE / 5 ) );
+    assert( !( (size_t)ptr1 % 4096 ) );
+    assert( !check_malloc() );
+
+    assert( ptr2 = memalign( 64, 100 ) );
+    assert( !( (size_t)ptr2 % 64 ) );
+    assert( !check_malloc() );
+
+    free( ptr1 );
+    free( ptr2 );
+    assert( !check_malloc() );
+
+    set_malloc_magazines( 1 );
+
+    assert( ptr1 = malloc( 100 ) );
+
+    free( ptr1 );
+
+    assert( ptr2 = malloc( 100 ) );
+    assert( ptr1 == ptr2 ); /* LIFO reuse of the cached chunk */
+
+    free( ptr2 );
+
+    set_malloc_magazines( 0 );
+    assert( !check_malloc() );
+
+    /* growing through the external allocator must cost one call */
+
+    assert( ptr1 = malloc( SIZE - 65536 ) );     /* most of mem1 */
+    assert( ptr2 = malloc( SIZE / 2 - 65536 ) ); /* most of mem2 */
+    assert( !check_malloc() );
+
+    set_external_alloc( external );
+
+    assert( ptr3 = malloc( SIZE / 8 ) );  /* must come from external */
+    assert( extra_calls == 1 );
+    assert( ptr3 >= extra && ptr3 < extra + sizeof( extra ) );
+    assert( !check_malloc() );
+
+    set_external_alloc( NULL );
+
+    free( ptr1 );
+    free( ptr2 );
+    free( ptr3 );
+    assert( !check_malloc() );
+
+    /* span slots have no boundary tags; realloc must honour that */
+
+    set_malloc_small_pages( 1 );
+
+    assert( ptr1 = malloc( 64 ) );
+
+    ptr1[ 0 ] = 42;
+    ptr1[ 63 ] = 24;
+
+    assert( ptr2 = realloc( ptr1, 8192 ) ); /* slot to chunk, copied out */
+    assert( ptr2[ 0 ] == 42 && ptr2[ 63 ] == 24 );
+    assert( !check_malloc() );
+
+    assert( ptr3 = malloc( 32 ) );
+    assert( !realloc_in_place( ptr3, 8192 ) ); /* can't grow a slot */
+    assert( realloc_in_place( ptr3, 8 ) == ptr3 );
+
+    free( ptr3 );
+    free( ptr2 );
+
+    set_malloc_small_pages( 0 );
+    assert( !check_malloc() );
+
+    void* batch[8];
+
+    assert( malloc_batch( 100, batch, 8 ) == 8 );
+    assert( !check_malloc() );
+
+    free_batch( batch, 8 );
+    assert( !check_malloc() );
+
+    /* a size * count overflow must fail cleanly, not wrap the span */
+
+    assert( malloc_batch( ( (size_t)1 << 61 ) - 12, batch, 8 ) == 0 );
+    assert( !check_malloc() );
+
+    /* malloc_sized taking the split remainder exact-fit must not leave
+       the locality heuristic pointing at the now-inuse chunk */
+
+    assert( ptr1 = malloc( 1000 ) ); /* a 1008-byte chunk...            */
+    assert( ptr2 = malloc( 16 ) );   /* ...fenced off the big chunk     */
+
+    free( ptr1 );
+
+    assert( ptr1 = malloc( 792 ) );  /* retakes it, remainder is 208    */
+    assert( ptr3 = malloc_sized( 200 ) ); /* exact-fit pop of the hint  */
+
+    void* small = malloc( 40 );      /* heuristic must not chase it     */
+
+    assert( small && !check_malloc() );
+
+    free( small );
+    free( ptr1 );
+    free( ptr2 );
+    free( ptr3 );
+    assert( !check_malloc() );
+
+    assert( ptr1 = malloc( 1000 ) );
+    assert( ptr2 = realloc( ptr1, SIZE / 4 ) );
+    assert( !check_malloc() );
+
+    assert( ptr3 = realloc_in_place( ptr2, 100 ) ); /* shrink never moves */
+    assert( ptr3 == ptr2 );
+    assert( !check_malloc() );
+
+    free( ptr3 );
+    assert( !check_malloc() );
+
+    assert( ptr1 = malloc( SIZE / 8 ) );
+
+    void* arena = malloc_arena_create( ptr1, SIZE / 8 );
+
+    assert( arena );
+    assert( ptr2 = arena_malloc( arena, 1000 ) );
+
+    arena_free( arena, ptr2 );
+
+    assert( ptr3 = arena_malloc( arena, 5000 ) );
+
+    arena_reset( arena );
+
+    /* after a reset the arena starts from scratch */
+
+    assert( ptr2 = arena_malloc( arena, 5000 ) );
+    assert( ptr2 == ptr3 );
+
+    arena_reset( arena );
+
+    free( ptr1 );
+    assert( !check_malloc() );
+
     printf( "SUCCESSFUL RUN!\n" );
     return 0;
 }